@@ -32,6 +32,7 @@
 
 #include <reaper_plugin.h>
 
+#include <atomic>
 #include <cassert>
 #include <mutex>
 #include <vector>
@@ -118,12 +119,69 @@ public:
 
 static std::mutex mtx;
 
+// Laid out like EEL's: a table of blocks, which are only allocated once a
+// script uses them. Only the first one is here.
 using gmem_block = double[NSEEL_RAM_ITEMSPERBLOCK];
-static gmem_block gmem[NSEEL_RAM_BLOCKS];
+static gmem_block gmem_first_block;
+static double *gmem_blocks[NSEEL_RAM_BLOCKS] = {gmem_first_block};
+static double **gmem = gmem_blocks;
+
+// Frames in plain memory, freed on the last Release
+class MockVideoFrame final : public IVideoFrame {
+  std::atomic<int> refs = 1;
+  std::vector<char> bits;
+  int w;
+  int h;
+  int fmt;
+  int rowspan;
+
+  void allocate() {
+    switch (fmt) {
+    case 'YV12':
+      // Y plane, then V and U planes of half the height and rowspan
+      rowspan = w;
+      bits.resize(size_t(rowspan) * h + size_t(rowspan / 2) * (h / 2) * 2);
+      break;
+    case 'YUY2':
+      rowspan = w * 2;
+      bits.resize(size_t(rowspan) * h);
+      break;
+    default:
+      fmt = 'RGBA';
+      rowspan = w * 4;
+      bits.resize(size_t(rowspan) * h);
+      break;
+    }
+  }
+
+public:
+  MockVideoFrame(int w, int h, int fmt) : w(w), h(h), fmt(fmt) { allocate(); }
+
+  void AddRef() { ++refs; }
+  void Release() {
+    if (--refs == 0) {
+      delete this;
+    }
+  }
+
+  char *get_bits() { return bits.data(); }
+  int get_w() { return w; }
+  int get_h() { return h; }
+  int get_fmt() { return fmt; }
+  int get_rowspan() { return rowspan; }
+  void resize_img(int wantw, int wanth, int wantfmt) {
+    w = wantw;
+    h = wanth;
+    fmt = wantfmt;
+    allocate();
+  }
+};
 
 class MockVideoProcessor final : public IREAPERVideoProcessor {
 public:
-  IVideoFrame *newVideoFrame(int w, int h, int fmt) { return nullptr; }
+  IVideoFrame *newVideoFrame(int w, int h, int fmt) {
+    return new MockVideoFrame(w, h, fmt);
+  }
 
   int getNumInputs() { return 0; }
   int getInputInfo(int idx, void **itemptr) { return 0; }
@@ -142,7 +200,7 @@ public:
     return EELMutex([]() { mtx.lock(); }, []() { mtx.unlock(); });
   }
 
-  double ***eel_gmem_attach() { return reinterpret_cast<double ***>(&gmem); }
+  double ***eel_gmem_attach() { return &gmem; }
 
   std::unique_ptr<IREAPERVideoProcessor> create_video_processor() {
     return std::make_unique<MockVideoProcessor>();
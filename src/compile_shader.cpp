@@ -25,11 +25,16 @@
 */
 
 #include "compile_shader.hpp"
+#include "ogler_cache.hpp"
 
 #include <glslang/Public/ShaderLang.h>
 #include <glslang/SPIRV/GlslangToSpv.h>
+#include <glslang/SPIRV/SPVRemapper.h>
 
 #include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 
@@ -165,6 +170,10 @@ class ParamCollector : public glslang::TIntermTraverser {
   std::vector<ParameterInfo> &params;
   std::optional<int> &output_width;
   std::optional<int> &output_height;
+  std::optional<int> &workgroup_size_x;
+  std::optional<int> &workgroup_size_y;
+  std::optional<unsigned> &gmem_range_offset;
+  std::optional<unsigned> &gmem_range_count;
   int params_binding;
 
   ParameterInfo *find_param(const std::string &name) {
@@ -184,7 +193,12 @@ class ParamCollector : public glslang::TIntermTraverser {
 public:
   ParamCollector(ShaderData &data, int params_binding)
       : params(data.parameters), output_width(data.output_width),
-        output_height(data.output_height), params_binding(params_binding) {}
+        output_height(data.output_height),
+        workgroup_size_x(data.workgroup_size_x),
+        workgroup_size_y(data.workgroup_size_y),
+        gmem_range_offset(data.gmem_range_offset),
+        gmem_range_count(data.gmem_range_count),
+        params_binding(params_binding) {}
 
   void visitSymbol(glslang::TIntermSymbol *sym) final {
     auto &type = sym->getType();
@@ -256,6 +270,16 @@ public:
       if (name == "ogler_output_resolution") {
         output_width = c[0].getIConst();
         output_height = c[1].getIConst();
+      } else if (name == "ogler_workgroup_size") {
+        workgroup_size_x = c[0].getIConst();
+        workgroup_size_y = c[1].getIConst();
+      }
+    } else if (isVector && sym->getBasicType() == glslang::EbtUint &&
+               c.size() == 2) {
+      auto &name = sym->getName();
+      if (name == "ogler_gmem_range") {
+        gmem_range_offset = c[0].getUConst();
+        gmem_range_count = c[1].getUConst();
       }
     }
   }
@@ -290,6 +314,135 @@ public:
   }
 };
 
+// Finds out which of the resources declared in the preamble are actually
+// read by the shader, so that the rest can be skipped when rendering. Errs on
+// the side of marking things as used: function definitions are all walked,
+// even if they're never called.
+class ResourceUsageCollector : public glslang::TIntermTraverser {
+  uint64_t &used_inputs;
+  bool &uses_gmem;
+  bool &uses_previous_frame;
+
+  static bool is_index(glslang::TOperator op) {
+    return op == glslang::EOpIndexDirect || op == glslang::EOpIndexIndirect;
+  }
+
+  // iChannel[] or iChannelResolution[]
+  static bool is_input_array(glslang::TIntermTyped *node) {
+    if (auto sym = node->getAsSymbolNode()) {
+      return sym->getName() == "iChannel";
+    }
+    if (auto bin = node->getAsBinaryNode()) {
+      auto block = bin->getLeft()->getAsSymbolNode();
+      return bin->getOp() == glslang::EOpIndexDirectStruct && block &&
+             block->getType().getTypeName() == "InputSizes";
+    }
+    return false;
+  }
+
+public:
+  ResourceUsageCollector(ShaderData &data)
+      : glslang::TIntermTraverser(true, false, false),
+        used_inputs(data.used_inputs), uses_gmem(data.uses_gmem),
+        uses_previous_frame(data.uses_previous_frame) {
+    used_inputs = 0;
+    uses_gmem = false;
+    uses_previous_frame = false;
+  }
+
+  void visitSymbol(glslang::TIntermSymbol *sym) final {
+    auto &name = sym->getName();
+    auto &type_name = sym->getType().getTypeName();
+    if (name == "iChannel" || type_name == "InputSizes") {
+      // Not indexed directly, e.g. passed to a function
+      used_inputs = ~uint64_t(0);
+    } else if (type_name == "Gmem") {
+      uses_gmem = true;
+    } else if (name == "ogler_previous_frame") {
+      uses_previous_frame = true;
+    }
+  }
+
+  bool visitBinary(glslang::TVisit, glslang::TIntermBinary *node) final {
+    if (!is_index(node->getOp()) || !is_input_array(node->getLeft())) {
+      return true;
+    }
+
+    std::optional<long long> index;
+    if (auto c = node->getRight()->getAsConstantUnion()) {
+      auto &value = c->getConstArray()[0];
+      index = c->getBasicType() == glslang::EbtUint ? value.getUConst()
+                                                     : value.getIConst();
+    }
+    if (index && *index >= 0 && *index < 64) {
+      used_inputs |= uint64_t(1) << *index;
+    } else {
+      used_inputs = ~uint64_t(0);
+    }
+
+    // The array itself has been accounted for, but the index expression may
+    // use other resources
+    node->getRight()->traverse(this);
+    return false;
+  }
+
+  bool visitAggregate(glslang::TVisit, glslang::TIntermAggregate *agg) final {
+    // Lists every global declaration, used or not
+    return agg->getOp() != glslang::EOpLinkerObjects;
+  }
+};
+
+// The buffer bound as gmem only covers the blocks of ogler_gmem_range, so
+// indices into it are made relative to the start of the first one. Shaders
+// keep using the usual indices.
+class GmemRebaser : public glslang::TIntermTraverser {
+  glslang::TIntermediate &intermediate;
+  unsigned base;
+
+  static bool is_gmem(glslang::TIntermTyped *node) {
+    auto bin = node->getAsBinaryNode();
+    if (!bin || bin->getOp() != glslang::EOpIndexDirectStruct) {
+      return false;
+    }
+    auto block = bin->getLeft()->getAsSymbolNode();
+    return block && block->getType().getTypeName() == "Gmem";
+  }
+
+  glslang::TIntermTyped *rebase(glslang::TIntermTyped *index) {
+    auto &loc = index->getLoc();
+    bool is_uint = index->getBasicType() == glslang::EbtUint;
+    if (auto c = index->getAsConstantUnion()) {
+      auto &value = c->getConstArray()[0];
+      return is_uint ? intermediate.addConstantUnion(value.getUConst() - base,
+                                                     loc, true)
+                     : intermediate.addConstantUnion(
+                           value.getIConst() - static_cast<int>(base), loc,
+                           true);
+    }
+    auto offset = is_uint ? intermediate.addConstantUnion(base, loc, true)
+                          : intermediate.addConstantUnion(
+                                static_cast<int>(base), loc, true);
+    return intermediate.addBinaryNode(
+        glslang::EOpSub, index, offset, loc,
+        glslang::TType(index->getBasicType(), glslang::EvqTemporary));
+  }
+
+public:
+  GmemRebaser(glslang::TIntermediate &intermediate, unsigned base)
+      : glslang::TIntermTraverser(true, false, false),
+        intermediate(intermediate), base(base) {}
+
+  bool visitBinary(glslang::TVisit, glslang::TIntermBinary *node) final {
+    if ((node->getOp() == glslang::EOpIndexDirect ||
+         node->getOp() == glslang::EOpIndexIndirect) &&
+        is_gmem(node->getLeft())) {
+      node->setRight(rebase(node->getRight()));
+    }
+    // The index expression may read gmem too
+    return true;
+  }
+};
+
 std::variant<ShaderData, std::string>
 compile_shader(const std::vector<std::pair<std::string, std::string>> &source,
                int params_binding) {
@@ -325,6 +478,14 @@ compile_shader(const std::vector<std::pair<std::string, std::string>> &source,
   auto iterm = prog.getIntermediate(EShLangCompute);
   try {
     iterm->getTreeRoot()->traverse(&collector);
+    ResourceUsageCollector usage(data);
+    iterm->getTreeRoot()->traverse(&usage);
+    auto gmem_base = data.gmem_range_offset.value_or(0) / gmem_block_items *
+                     gmem_block_items;
+    if (data.uses_gmem && gmem_base > 0) {
+      GmemRebaser rebaser(*iterm, gmem_base);
+      iterm->getTreeRoot()->traverse(&rebaser);
+    }
   } catch (std::runtime_error &e) {
     return e.what();
   }
@@ -332,6 +493,23 @@ compile_shader(const std::vector<std::pair<std::string, std::string>> &source,
   return data;
 }
 
+uint64_t canonical_spirv_hash(const std::vector<unsigned> &spirv_code) {
+  // The remapper exits the process on malformed input by default
+  static std::once_flag handler_once;
+  std::call_once(handler_once, []() {
+    spv::spirvbin_t::registerErrorHandler(
+        [](const std::string &msg) { throw std::runtime_error(msg); });
+  });
+
+  std::vector<std::uint32_t> canonical(spirv_code.begin(), spirv_code.end());
+  try {
+    spv::spirvbin_t().remap(canonical, spv::spirvbin_t::DO_EVERYTHING);
+  } catch (std::runtime_error &) {
+    canonical.assign(spirv_code.begin(), spirv_code.end());
+  }
+  return hash_span(std::span{canonical});
+}
+
 void to_json(nlohmann::json &j, const ParameterInfo &p) {
   j = {
       {"name", p.name},
@@ -353,4 +531,110 @@ void from_json(const nlohmann::json &j, ParameterInfo &p) {
   j.at("middle_value").get_to(p.middle_value);
   j.at("step_size").get_to(p.step_size);
 }
+
+static constexpr const char *base64_chars =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string encode_spirv(const std::vector<unsigned> &code) {
+  auto bytes = std::as_bytes(std::span{code});
+  std::string res;
+  res.reserve((bytes.size() + 2) / 3 * 4);
+  for (size_t i = 0; i < bytes.size(); i += 3) {
+    uint32_t chunk = 0;
+    size_t n = std::min<size_t>(3, bytes.size() - i);
+    for (size_t k = 0; k < n; ++k) {
+      chunk |= static_cast<uint32_t>(bytes[i + k]) << (16 - 8 * k);
+    }
+    for (size_t k = 0; k < 4; ++k) {
+      res.push_back(k <= n ? base64_chars[(chunk >> (18 - 6 * k)) & 0x3f]
+                           : '=');
+    }
+  }
+  return res;
+}
+
+static std::vector<unsigned> decode_spirv(const std::string &str) {
+  if (str.size() % 4 != 0) {
+    throw std::invalid_argument("Invalid base64 string");
+  }
+
+  std::vector<uint8_t> bytes;
+  bytes.reserve(str.size() / 4 * 3);
+  for (size_t i = 0; i < str.size(); i += 4) {
+    uint32_t chunk = 0;
+    size_t n = 3;
+    for (size_t k = 0; k < 4; ++k) {
+      uint32_t value = 0;
+      if (str[i + k] == '=' && k >= 2) {
+        n = std::min(n, k - 1);
+      } else {
+        auto pos = std::strchr(base64_chars, str[i + k]);
+        if (!pos || !*pos) {
+          throw std::invalid_argument("Invalid base64 string");
+        }
+        value = static_cast<uint32_t>(pos - base64_chars);
+      }
+      chunk |= value << (18 - 6 * k);
+    }
+    for (size_t k = 0; k < n; ++k) {
+      bytes.push_back(static_cast<uint8_t>(chunk >> (16 - 8 * k)));
+    }
+  }
+
+  if (bytes.size() % sizeof(unsigned) != 0) {
+    throw std::invalid_argument("Invalid SPIR-V size");
+  }
+  std::vector<unsigned> code(bytes.size() / sizeof(unsigned));
+  std::memcpy(code.data(), bytes.data(), bytes.size());
+  return code;
+}
+
+template <typename T>
+static void optional_to_json(nlohmann::json &j, const char *name,
+                             const std::optional<T> &value) {
+  if (value) {
+    j[name] = *value;
+  }
+}
+
+template <typename T>
+static void optional_from_json(const nlohmann::json &j, const char *name,
+                               std::optional<T> &value) {
+  auto it = j.find(name);
+  if (it == j.end()) {
+    value = std::nullopt;
+  } else {
+    value = it->get<T>();
+  }
+}
+
+void to_json(nlohmann::json &j, const ShaderData &d) {
+  j = {
+      {"spirv", encode_spirv(d.spirv_code)},
+      {"parameters", d.parameters},
+  };
+  optional_to_json(j, "output_width", d.output_width);
+  optional_to_json(j, "output_height", d.output_height);
+  optional_to_json(j, "workgroup_size_x", d.workgroup_size_x);
+  optional_to_json(j, "workgroup_size_y", d.workgroup_size_y);
+  optional_to_json(j, "gmem_range_offset", d.gmem_range_offset);
+  optional_to_json(j, "gmem_range_count", d.gmem_range_count);
+  j["used_inputs"] = d.used_inputs;
+  j["uses_gmem"] = d.uses_gmem;
+  j["uses_previous_frame"] = d.uses_previous_frame;
+}
+
+void from_json(const nlohmann::json &j, ShaderData &d) {
+  d.spirv_code = decode_spirv(j.at("spirv").get<std::string>());
+  j.at("parameters").get_to(d.parameters);
+  optional_from_json(j, "output_width", d.output_width);
+  optional_from_json(j, "output_height", d.output_height);
+  optional_from_json(j, "workgroup_size_x", d.workgroup_size_x);
+  optional_from_json(j, "workgroup_size_y", d.workgroup_size_y);
+  optional_from_json(j, "gmem_range_offset", d.gmem_range_offset);
+  optional_from_json(j, "gmem_range_count", d.gmem_range_count);
+  j.at("used_inputs").get_to(d.used_inputs);
+  j.at("uses_gmem").get_to(d.uses_gmem);
+  j.at("uses_previous_frame").get_to(d.uses_previous_frame);
+}
 } // namespace ogler
\ No newline at end of file
@@ -26,6 +26,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <optional>
 #include <string>
 #include <utility>
 #include <variant>
@@ -35,6 +37,11 @@
 
 namespace ogler {
 
+// gmem is uploaded in EEL RAM blocks of this many elements. Shaders that
+// declare ogler_gmem_range index gmem from the start of the block their range
+// begins in.
+constexpr unsigned gmem_block_items = 65536;
+
 struct ParameterInfo {
   std::string name;
   std::string display_name;
@@ -43,6 +50,8 @@ struct ParameterInfo {
   float maximum_val;
   float middle_value;
   float step_size;
+
+  bool operator==(const ParameterInfo &) const = default;
 };
 
 struct Parameter {
@@ -58,9 +67,27 @@ struct ShaderData {
   std::vector<ParameterInfo> parameters;
   std::optional<int> output_width;
   std::optional<int> output_height;
+  std::optional<int> workgroup_size_x;
+  std::optional<int> workgroup_size_y;
+  std::optional<unsigned> gmem_range_offset;
+  std::optional<unsigned> gmem_range_count;
+
+  // Resources the shader actually reads. Bit i of used_inputs is set if
+  // iChannel[i] or iChannelResolution[i] may be read.
+  uint64_t used_inputs = ~uint64_t(0);
+  bool uses_gmem = true;
+  bool uses_previous_frame = true;
 };
 
+// SPIR-V is stored as base64
+void to_json(nlohmann::json &j, const ShaderData &d);
+void from_json(const nlohmann::json &j, ShaderData &d);
+
 std::variant<ShaderData, std::string>
 compile_shader(const std::vector<std::pair<std::string, std::string>> &source,
                int params_binding);
+
+// Hash of the code with names and debug info stripped and IDs renumbered, so
+// that shaders which only differ in those hash the same
+uint64_t canonical_spirv_hash(const std::vector<unsigned> &spirv_code);
 } // namespace ogler
\ No newline at end of file
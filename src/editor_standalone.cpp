@@ -38,6 +38,7 @@ static ogler::Editor *editor;
 class MockEditorInterface final : public ogler::EditorInterface {
   std::string source;
   int zoom{1};
+  int frames_in_flight{1};
   int w;
   int h;
   std::vector<ogler::Parameter> params;
@@ -63,7 +64,13 @@ public:
 
   void set_height(int h) final { this->h = h; }
 
+  int get_frames_in_flight() final { return frames_in_flight; }
+
+  void set_frames_in_flight(int frames) final { frames_in_flight = frames; }
+
   void set_parameter(size_t idx, float value) final {}
+
+  std::string get_memory_usage() final { return {}; }
 };
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
@@ -81,6 +81,10 @@ extern "C" CLAP_EXPORT const clap_plugin_entry_t clap_entry{
           ogler::shared_vulkan = std::make_unique<ogler::SharedVulkan>();
           return true;
         },
-    .deinit = []() { ogler::shared_vulkan = nullptr; },
+    .deinit =
+        []() {
+          ogler::shared_vulkan->save_pipeline_cache();
+          ogler::shared_vulkan = nullptr;
+        },
     .get_factory = &clap::plugin_factory<ogler_plugin>::getter,
 };
\ No newline at end of file
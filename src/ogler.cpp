@@ -26,8 +26,11 @@
 
 #include "ogler.hpp"
 #include "compile_shader.hpp"
+#include "ogler_cache.hpp"
+#include "ogler_convert.hpp"
 #include "ogler_debug.hpp"
 #include "ogler_editor.hpp"
+#include "ogler_yuv.hpp"
 #include "sciter_scintilla.hpp"
 
 #include <clap/events.h>
@@ -40,6 +43,11 @@
 #include <reaper_plugin_functions.h>
 
 #include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdlib>
+#include <execution>
+#include <limits>
 #include <optional>
 #include <sstream>
 #include <utility>
@@ -57,6 +65,50 @@ static constexpr unsigned max_num_inputs = 64;
 
 static constexpr uint32_t gmem_size =
     NSEEL_RAM_BLOCKS * NSEEL_RAM_ITEMSPERBLOCK;
+static_assert(gmem_block_items == NSEEL_RAM_ITEMSPERBLOCK);
+
+// GPU memory that input frames no instance is using may keep occupied
+static constexpr size_t input_cache_capacity = size_t(512) << 20;
+// GPU memory that output images and staging buffers no instance is using may
+// keep occupied
+static constexpr size_t resource_pool_capacity = size_t(256) << 20;
+// Host memory imports kept around for when REAPER hands back the same frames
+static constexpr size_t host_import_cache_capacity = 32;
+// Smaller frames are copied to staging instead of being imported: the copy is
+// cheap, and every import takes a memory object of its own
+static constexpr size_t min_host_import_size = size_t(1) << 20;
+// Enough for gmem deltas and a few input frames per frame in flight. Uploads
+// that don't fit fall back to buffers from the resource pool.
+static constexpr vk::DeviceSize staging_ring_size = vk::DeviceSize(64) << 20;
+// Smallest buffer taken from the resource pool for uploads that don't fit in
+// the staging ring
+static constexpr size_t min_staging_overflow_size = size_t(64) << 10;
+// Each queue in use gets its own copy of gmem, which caps the memory that
+// takes
+static constexpr uint32_t max_submit_queues = 4;
+
+// Outputs are copied for downstream instances until this many frames go by
+// without one using them, and then only every handoff_probe_interval frames
+static constexpr uint64_t handoff_idle_limit = 8;
+static constexpr uint64_t handoff_probe_interval = 64;
+
+// Compilation results kept around for instances that load the same shader a
+// little later, on top of the ones still in progress
+static constexpr size_t compile_cache_capacity = 64;
+// Most projects only use a handful of different shaders, and compiling them
+// doesn't need the whole machine
+static constexpr size_t max_compile_threads = 4;
+
+// Set OGLER_BATCH_WINDOW_US to batch the frames that instances submit within
+// that many microseconds of each other into a single vkQueueSubmit, see
+// docs/Reference.md. Off by default, since instances that don't render delay
+// the others by up to the window.
+static std::chrono::microseconds get_batch_window() {
+  if (auto value = std::getenv("OGLER_BATCH_WINDOW_US")) {
+    return std::chrono::microseconds(std::strtoul(value, nullptr, 10));
+  }
+  return {};
+}
 
 struct Uniforms {
   float iResolution_w, iResolution_h;
@@ -65,6 +117,9 @@ struct Uniforms {
   float iFrameRate;
   float iWet;
   int num_inputs;
+  // Layout of the output pixels buffer, in pixels
+  unsigned output_row_length;
+  unsigned output_offset;
 };
 static_assert(sizeof(Uniforms) < 128,
               "Keep this under 128 bytes to ensure compatibility!");
@@ -79,17 +134,18 @@ struct SpecializationData {
   int ogler_version_maj;
   int ogler_version_min;
   int ogler_version_rev;
+  unsigned workgroup_size_x;
+  unsigned workgroup_size_y;
+  VkBool32 store_output_image;
 };
 
-struct Ogler::Compute {
+// Everything about a compiled shader that doesn't depend on the instance
+// running it
+struct SharedPipeline {
   vk::raii::ShaderModule shader;
   vk::raii::DescriptorSetLayout descriptor_set_layout;
-  vk::raii::DescriptorPool descriptor_pool;
-  vk::raii::DescriptorSet descriptor_set;
-
-  vk::raii::PipelineCache pipeline_cache;
   vk::raii::PipelineLayout pipeline_layout;
-  std::array<vk::SpecializationMapEntry, 4> pipeline_spec_entries{
+  std::array<vk::SpecializationMapEntry, 7> pipeline_spec_entries{
       // ogler_gmem_size
       vk::SpecializationMapEntry{
           .constantID = 0,
@@ -118,13 +174,29 @@ struct Ogler::Compute {
               offsetof(SpecializationData, ogler_version_rev)),
           .size = sizeof(SpecializationData::ogler_version_rev),
       },
+      // local_size_x
+      vk::SpecializationMapEntry{
+          .constantID = 4,
+          .offset = static_cast<uint32_t>(
+              offsetof(SpecializationData, workgroup_size_x)),
+          .size = sizeof(SpecializationData::workgroup_size_x),
+      },
+      // local_size_y
+      vk::SpecializationMapEntry{
+          .constantID = 5,
+          .offset = static_cast<uint32_t>(
+              offsetof(SpecializationData, workgroup_size_y)),
+          .size = sizeof(SpecializationData::workgroup_size_y),
+      },
+      // ogler_store_output_image
+      vk::SpecializationMapEntry{
+          .constantID = 6,
+          .offset = static_cast<uint32_t>(
+              offsetof(SpecializationData, store_output_image)),
+          .size = sizeof(SpecializationData::store_output_image),
+      },
   };
-  SpecializationData pipeline_spec_data{
-      .gmem_size = gmem_size,
-      .ogler_version_maj = version::major,
-      .ogler_version_min = version::minor,
-      .ogler_version_rev = version::revision,
-  };
+  SpecializationData pipeline_spec_data;
   vk::SpecializationInfo pipeline_spec_info{
       .mapEntryCount = static_cast<uint32_t>(pipeline_spec_entries.size()),
       .pMapEntries = pipeline_spec_entries.data(),
@@ -178,6 +250,13 @@ struct Ogler::Compute {
             .descriptorCount = 1,
             .stageFlags = vk::ShaderStageFlagBits::eCompute,
         },
+        // ogler_output_pixels
+        {
+            .binding = 6,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        },
     };
     vk::DescriptorSetLayoutCreateInfo layout_info{
         .bindingCount = static_cast<uint32_t>(bindings.size()),
@@ -187,119 +266,268 @@ struct Ogler::Compute {
     return ctx.device.createDescriptorSetLayout(layout_info);
   }
 
-  static vk::raii::DescriptorPool create_descriptor_pool(VulkanContext &ctx) {
+  SharedPipeline(VulkanContext &ctx, vk::raii::PipelineCache &pipeline_cache,
+                 const std::vector<unsigned> &shader_code,
+                 unsigned workgroup_size_x, unsigned workgroup_size_y,
+                 bool store_output_image)
+      : shader(ctx.create_shader_module(shader_code)),
+        descriptor_set_layout(create_descriptor_set_layout(ctx)),
+        pipeline_layout(ctx.create_pipeline_layout(descriptor_set_layout,
+                                                   sizeof(Uniforms))),
+        pipeline_spec_data{
+            .gmem_size = gmem_size,
+            .ogler_version_maj = version::major,
+            .ogler_version_min = version::minor,
+            .ogler_version_rev = version::revision,
+            .workgroup_size_x = workgroup_size_x,
+            .workgroup_size_y = workgroup_size_y,
+            .store_output_image = store_output_image,
+        },
+        pipeline(ctx.create_compute_pipeline(shader, "main", pipeline_layout,
+                                             pipeline_cache,
+                                             &pipeline_spec_info)) {}
+};
+
+struct Ogler::Compute {
+  // Declared first so that the descriptor set layout outlives the sets
+  std::shared_ptr<SharedPipeline> shared;
+  vk::raii::DescriptorPool descriptor_pool;
+  // One for each frame in flight
+  std::vector<vk::raii::DescriptorSet> descriptor_sets;
+
+  static vk::raii::DescriptorPool create_descriptor_pool(VulkanContext &ctx,
+                                                         uint32_t num_sets) {
     std::vector<vk::DescriptorPoolSize> pool_sizes = {
         // Input texture
         {
             .type = vk::DescriptorType::eCombinedImageSampler,
-            .descriptorCount = max_num_inputs,
+            .descriptorCount = max_num_inputs * num_sets,
         },
         // Output texture
         {
             .type = vk::DescriptorType::eStorageImage,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // gmem
         {
             .type = vk::DescriptorType::eStorageBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // iChannelResolution[]
         {
             .type = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // ogler_previous_frame
         {
             .type = vk::DescriptorType::eCombinedImageSampler,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
         },
         // Params
         {
             .type = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = num_sets,
+        },
+        // ogler_output_pixels
+        {
+            .type = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = num_sets,
         },
     };
 
     vk::DescriptorPoolCreateInfo create_info{
         .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
-        .maxSets = 1,
+        .maxSets = num_sets,
         .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
         .pPoolSizes = pool_sizes.data(),
     };
     return ctx.device.createDescriptorPool(create_info);
   }
 
-  static vk::raii::DescriptorSet
-  create_descriptor_set(VulkanContext &ctx, vk::raii::DescriptorPool &pool,
-                        vk::raii::DescriptorSetLayout &layout) {
+  static std::vector<vk::raii::DescriptorSet>
+  create_descriptor_sets(VulkanContext &ctx, vk::raii::DescriptorPool &pool,
+                         vk::raii::DescriptorSetLayout &layout,
+                         uint32_t num_sets) {
+    std::vector<vk::DescriptorSetLayout> layouts(num_sets, *layout);
     vk::DescriptorSetAllocateInfo alloc_info{
         .descriptorPool = *pool,
-        .descriptorSetCount = 1,
-        .pSetLayouts = &*layout,
+        .descriptorSetCount = num_sets,
+        .pSetLayouts = layouts.data(),
     };
-    return std::move(ctx.device.allocateDescriptorSets(alloc_info).front());
+    return ctx.device.allocateDescriptorSets(alloc_info);
   }
 
-  Compute(VulkanContext &ctx, const std::vector<unsigned> &shader_code)
-      : shader(ctx.create_shader_module(shader_code)),
-        descriptor_set_layout(create_descriptor_set_layout(ctx)),
-        descriptor_pool(create_descriptor_pool(ctx)),
-        descriptor_set(
-            create_descriptor_set(ctx, descriptor_pool, descriptor_set_layout)),
-        pipeline_cache(ctx.create_pipeline_cache()),
-        pipeline_layout(ctx.create_pipeline_layout(descriptor_set_layout,
-                                                   sizeof(Uniforms))),
-        pipeline(ctx.create_compute_pipeline(shader, "main", pipeline_layout,
-                                             pipeline_cache,
-                                             &pipeline_spec_info)) {}
+  Compute(VulkanContext &ctx, std::shared_ptr<SharedPipeline> pipeline,
+          uint32_t num_sets)
+      : shared(std::move(pipeline)),
+        descriptor_pool(create_descriptor_pool(ctx, num_sets)),
+        descriptor_sets(create_descriptor_sets(ctx, descriptor_pool,
+                                               shared->descriptor_set_layout,
+                                               num_sets)) {}
 };
 
-SharedVulkan::SharedVulkan()
-    : gmem_transfer_buffer(vulkan.create_buffer<float>(
-          {}, gmem_size, vk::BufferUsageFlagBits::eTransferSrc,
-          vk::SharingMode::eExclusive,
-          vk::MemoryPropertyFlagBits::eHostVisible |
-              vk::MemoryPropertyFlagBits::eHostCoherent)),
-      gmem_buffer(vulkan.create_buffer<float>(
-          {}, gmem_size,
+// Everything that results from compiling a shader. Built in the background
+// and never modified once it's handed over to the video thread.
+struct Ogler::RenderState {
+  std::unique_ptr<Compute> compute;
+  std::vector<ParameterInfo> parameters;
+  std::optional<int> output_width;
+  std::optional<int> output_height;
+  // EEL RAM blocks covering ogler_gmem_range, only these are uploaded
+  size_t gmem_first_block;
+  size_t gmem_end_block;
+  uint64_t used_inputs;
+  bool uses_gmem;
+  bool uses_previous_frame;
+};
+
+YuvConverter *SharedVulkan::get_yuv_converter() {
+  std::call_once(yuv_converter_once, [this]() {
+    try {
+      yuv_converter = std::make_unique<YuvConverter>(vulkan, pipeline_cache);
+    } catch (std::exception &) {
+      // Inputs are then requested as RGBA
+    }
+  });
+  return yuv_converter.get();
+}
+
+std::shared_ptr<SharedGmem> SharedVulkan::get_gmem(uint32_t queue_index,
+                                                   size_t first_block,
+                                                   size_t end_block) {
+  std::unique_lock<std::mutex> lock(gmem_mutex);
+  auto &entry = gmem[queue_index];
+  if (entry && entry->first_block <= first_block &&
+      entry->end_block >= end_block) {
+    return entry;
+  }
+  // The new copy starts out empty, so every block gets uploaded again
+  if (entry) {
+    first_block = std::min(first_block, entry->first_block);
+    end_block = std::max(end_block, entry->end_block);
+  }
+  entry.reset(new SharedGmem{
+      .buffer = vulkan.create_buffer<float>(
+          {}, (end_block - first_block) * NSEEL_RAM_ITEMSPERBLOCK,
           vk::BufferUsageFlagBits::eTransferDst |
               vk::BufferUsageFlagBits::eStorageBuffer,
-          vk::SharingMode::eExclusive, vk::MemoryPropertyFlagBits::eDeviceLocal,
-          false)) {}
+          vk::SharingMode::eExclusive,
+          vk::MemoryPropertyFlagBits::eDeviceLocal, false),
+      .first_block = first_block,
+      .end_block = end_block,
+      .blocks = std::vector<GmemBlock>(NSEEL_RAM_BLOCKS),
+  });
+  return entry;
+}
+
+std::shared_ptr<SharedPipeline>
+PipelineRegistry::find(const Key &key) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  return it == entries.end() ? nullptr : it->second.lock();
+}
 
-static void transition_image_layout_download(vk::raii::CommandBuffer &cmd,
-                                             Image &image) {
-  auto old_layout = vk::ImageLayout::eUndefined;
-  auto new_layout = vk::ImageLayout::eGeneral;
+std::shared_ptr<SharedPipeline>
+PipelineRegistry::insert(const Key &key,
+                         std::shared_ptr<SharedPipeline> pipeline) {
+  std::unique_lock<std::mutex> lock(mutex);
+  std::erase_if(entries, [](auto &entry) { return entry.second.expired(); });
+  auto &entry = entries[key];
+  if (auto existing = entry.lock()) {
+    return existing;
+  }
+  entry = pipeline;
+  return pipeline;
+}
 
-  vk::ImageMemoryBarrier barrier{
-      .oldLayout = old_layout,
-      .newLayout = new_layout,
-      .image = *image.image,
-      .subresourceRange =
-          {
-              .aspectMask = vk::ImageAspectFlagBits::eColor,
-              .levelCount = 1,
-              .layerCount = 1,
-          },
-  };
+SharedVulkan::SharedVulkan()
+    : workgroup_sizes(get_cache_directory() / "workgroup_sizes.json"),
+      pipeline_cache_path(get_cache_directory() /
+                          ("pipeline_cache-" + vulkan.device_key() + ".bin")),
+      pipeline_cache(
+          vulkan.create_pipeline_cache(read_binary_file(pipeline_cache_path))),
+      scheduler(vulkan, max_submit_queues, get_batch_window()),
+      gmem(scheduler.num_queues()),
+      input_cache(input_cache_capacity),
+      resource_pool(vulkan, resource_pool_capacity),
+      host_imports(vulkan, host_import_cache_capacity),
+      staging_ring(vulkan, staging_ring_size),
+      compile_service(max_compile_threads, compile_cache_capacity) {}
+
+void SharedVulkan::save_pipeline_cache() {
+  // Other REAPER instances may have saved their own pipelines since this one
+  // was loaded: merge them in, so that neither overwrites the other
+  try {
+    auto on_disk = vulkan.create_pipeline_cache(
+        read_binary_file(pipeline_cache_path));
+    pipeline_cache.merge({*on_disk});
+    write_binary_file(pipeline_cache_path, pipeline_cache.getData());
+  } catch (vk::Error &) {
+    // The cache is only an optimization
+  }
+}
 
-  vk::PipelineStageFlags sourceStage;
-  vk::PipelineStageFlags destinationStage;
+InputCache::InputCache(size_t capacity) : capacity(capacity) {}
 
-  barrier.setSrcAccessMask({});
-  barrier.setDstAccessMask(vk::AccessFlagBits::eTransferRead);
+InputCache::EntryList::iterator InputCache::erase(EntryList::iterator it) {
+  auto [first, last] = by_hash.equal_range((*it)->hash);
+  by_hash.erase(std::find_if(first, last,
+                             [&](auto &entry) { return entry.second == it; }));
+  total_bytes -= (*it)->size_bytes();
+  return entries.erase(it);
+}
 
-  sourceStage = vk::PipelineStageFlagBits::eComputeShader;
-  destinationStage = vk::PipelineStageFlagBits::eTransfer;
+std::shared_ptr<CachedInput> InputCache::find(uint64_t hash, int w, int h) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto [first, last] = by_hash.equal_range(hash);
+  auto match = std::find_if(first, last, [&](auto &entry) {
+    auto &image = (*entry.second)->image;
+    return image.width == w && image.height == h;
+  });
+  if (match == last) {
+    return nullptr;
+  }
+  // Splicing keeps the iterator valid
+  entries.splice(entries.begin(), entries, match->second);
+  return entries.front();
+}
 
-  cmd.pipelineBarrier(sourceStage, destinationStage, {}, {}, {}, {barrier});
+std::shared_ptr<CachedInput> InputCache::reclaim(int w, int h) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (total_bytes + size_t(w) * h * 4 <= capacity) {
+    return nullptr;
+  }
+  // Only the cache holds a reference to entries no frame is using
+  auto it = std::find_if(entries.rbegin(), entries.rend(), [&](auto &entry) {
+    return entry.use_count() == 1 && entry->image.width == w &&
+           entry->image.height == h;
+  });
+  if (it == entries.rend()) {
+    return nullptr;
+  }
+  auto entry = *it;
+  erase(std::next(it).base());
+  return entry;
+}
+
+void InputCache::insert(std::shared_ptr<CachedInput> entry) {
+  std::unique_lock<std::mutex> lock(mutex);
+  total_bytes += entry->size_bytes();
+  auto hash = entry->hash;
+  entries.push_front(std::move(entry));
+  by_hash.emplace(hash, entries.begin());
+  // Least recently used first, never the entry that was just inserted
+  auto it = entries.end();
+  while (total_bytes > capacity && --it != entries.begin()) {
+    if (it->use_count() == 1) {
+      it = erase(it);
+    }
+  }
 }
 
-int Ogler::get_output_width() {
-  if (shader_output_width.has_value()) {
-    return *shader_output_width;
+int Ogler::get_output_width(const RenderState *state) {
+  if (state && state->output_width.has_value()) {
+    return *state->output_width;
   } else {
     auto [w, h] = reaper->get_current_project_size(fallback_output_width,
                                                    fallback_output_height);
@@ -307,9 +535,9 @@ int Ogler::get_output_width() {
   }
 }
 
-int Ogler::get_output_height() {
-  if (shader_output_height.has_value()) {
-    return *shader_output_height;
+int Ogler::get_output_height(const RenderState *state) {
+  if (state && state->output_height.has_value()) {
+    return *state->output_height;
   } else {
     auto [w, h] = reaper->get_current_project_size(fallback_output_width,
                                                    fallback_output_height);
@@ -321,51 +549,34 @@ static ScintillaEditorFactory scintilla_factory(get_hinstance());
 
 Ogler::Ogler(const clap::host &host)
     : host(host), reaper(IReaper::get_reaper(host)),
-      shared(get_shared_vulkan()),
-      command_buffer(shared.vulkan.create_command_buffer()),
-      queue(shared.vulkan.get_queue(0)), fence(shared.vulkan.create_fence()),
-      sampler(shared.vulkan.create_sampler()),
-      output_transfer_buffer(shared.vulkan.create_buffer<char>(
-          {}, get_output_width() * get_output_height() * 4,
-          vk::BufferUsageFlagBits::eTransferDst, vk::SharingMode::eExclusive,
-          vk::MemoryPropertyFlagBits::eHostVisible |
-              vk::MemoryPropertyFlagBits::eHostCoherent)),
-      output_image(
-          shared.vulkan.create_image(get_output_width(), get_output_height(),
-                                     RGBAFormat, vk::ImageTiling::eOptimal,
-                                     vk::ImageUsageFlagBits::eStorage |
-                                         vk::ImageUsageFlagBits::eTransferSrc |
-                                         vk::ImageUsageFlagBits::eSampled)),
-      output_image_view(
-          shared.vulkan.create_image_view(output_image, RGBAFormat)),
-      previous_image(
-          shared.vulkan.create_image(get_output_width(), get_output_height(),
-                                     RGBAFormat, vk::ImageTiling::eOptimal,
-                                     vk::ImageUsageFlagBits::eStorage |
-                                         vk::ImageUsageFlagBits::eTransferSrc |
-                                         vk::ImageUsageFlagBits::eSampled)),
-      previous_image_view(
-          shared.vulkan.create_image_view(previous_image, RGBAFormat)),
-      empty_input(create_input_image(1, 1)),
-      input_resolution_buffer(
-          shared.vulkan.create_buffer<std::pair<float, float>>(
-              {}, max_num_inputs, vk::BufferUsageFlagBits::eUniformBuffer,
-              vk::SharingMode::eExclusive,
-              vk::MemoryPropertyFlagBits::eHostCoherent |
-                  vk::MemoryPropertyFlagBits::eHostVisible)) {}
+      shared(get_shared_vulkan()), sampler(shared.vulkan.create_sampler()),
+      command_pool(shared.vulkan.create_compute_command_pool()),
+      command_buffer(shared.vulkan.create_command_buffer(command_pool)),
+      queue_index(shared.scheduler.acquire_queue()),
+      fence(shared.vulkan.create_fence()),
+      empty_input(create_input_image(1, 1)) {}
 
 Ogler::~Ogler() {
+  std::vector<std::future<void>> tasks;
+  {
+    std::unique_lock<std::mutex> lock(compile_mutex);
+    ++compile_generation;
+    tasks = std::move(compile_tasks);
+  }
+  for (auto &task : tasks) {
+    task.wait();
+  }
+
   std::unique_lock<std::mutex> lock(video_mutex);
   vproc = nullptr;
+  drain_frames();
+  shared.scheduler.release_queue(queue_index);
 }
 
 bool Ogler::init() {
   eel_mutex = reaper->get_eel_mutex();
 
-  one_shot_execute([&]() {
-    transition_image_layout_download(command_buffer, output_image);
-    transition_image_layout_download(command_buffer, previous_image);
-  });
+  create_frames(1);
 
   gmem = reaper->eel_gmem_attach();
 
@@ -374,41 +585,39 @@ bool Ogler::init() {
 
 bool Ogler::activate(double sample_rate, uint32_t min_frames_count,
                      uint32_t max_frames_count) {
-  compiler_error = recompile_shaders();
-
-  if (!compiler_error.has_value()) {
-    if (editor) {
-      editor->params_changed(data.parameters);
+  // Until the shader is compiled, the video processor keeps using the last
+  // pipeline that compiled successfully, if any
+  recompile_shaders();
+
+  vproc = reaper->create_video_processor();
+  vproc->userdata = this;
+  vproc->process_frame =
+      [](IREAPERVideoProcessor *vproc, const double *parmlist, int nparms,
+         double project_time, double frate, int force_format) {
+        auto plugin = static_cast<Ogler *>(vproc->userdata);
+        return plugin->video_process_frame(
+            std::span{parmlist, static_cast<size_t>(nparms)}, project_time,
+            frate, static_cast<FrameFormat>(force_format));
+      };
+  vproc->get_parameter_value = [](IREAPERVideoProcessor *vproc, int idx,
+                                  double *valueOut) -> bool {
+    auto plugin = static_cast<Ogler *>(vproc->userdata);
+    auto val = plugin->params_get_value(static_cast<clap_id>(idx));
+    if (val.has_value()) {
+      *valueOut = *val;
+      return true;
+    } else {
+      return false;
     }
-    vproc = reaper->create_video_processor();
-    vproc->userdata = this;
-    vproc->process_frame =
-        [](IREAPERVideoProcessor *vproc, const double *parmlist, int nparms,
-           double project_time, double frate, int force_format) {
-          auto plugin = static_cast<Ogler *>(vproc->userdata);
-          return plugin->video_process_frame(
-              std::span{parmlist, static_cast<size_t>(nparms)}, project_time,
-              frate, static_cast<FrameFormat>(force_format));
-        };
-    vproc->get_parameter_value = [](IREAPERVideoProcessor *vproc, int idx,
-                                    double *valueOut) -> bool {
-      auto plugin = static_cast<Ogler *>(vproc->userdata);
-      auto val = plugin->params_get_value(static_cast<clap_id>(idx));
-      if (val.has_value()) {
-        *valueOut = *val;
-        return true;
-      } else {
-        return false;
-      }
-    };
-  } else if (editor) {
-    editor->compiler_error(*compiler_error);
-  }
+  };
   return true;
 }
 void Ogler::deactivate() {
   std::unique_lock<std::mutex> lock(video_mutex);
   vproc = nullptr;
+  // The frames in flight would otherwise hold on to their staging ranges
+  // until the next activation, and hold back the ring for every instance
+  drain_frames();
 }
 
 bool Ogler::start_processing() { return true; }
@@ -435,7 +644,55 @@ clap_process_status Ogler::process(const clap_process_t &process) {
 
 void *Ogler::get_extension(std::string_view id) { return nullptr; }
 
-void Ogler::on_main_thread() {}
+void Ogler::on_main_thread() {
+  std::optional<CompileResult> result;
+  {
+    std::unique_lock<std::mutex> lock(compile_mutex);
+    result = std::exchange(compile_result, std::nullopt);
+  }
+  if (!result) {
+    return;
+  }
+
+  if (auto error = std::get_if<std::string>(&result->data)) {
+    compiler_error = std::move(*error);
+    if (editor) {
+      editor->compiler_error(*compiler_error);
+    }
+    return;
+  }
+
+  auto &shader_data = std::get<ShaderData>(result->data);
+  compiler_error = std::nullopt;
+  bool params_changed = std::exchange(params_rescan_pending, false);
+  {
+    std::unique_lock<std::recursive_mutex> params_lock(params_mutex);
+    params_changed |= !std::equal(
+        data.parameters.begin(), data.parameters.end(),
+        shader_data.parameters.begin(), shader_data.parameters.end(),
+        [](const Parameter &a, const ParameterInfo &b) { return a.info == b; });
+
+    size_t old_num = data.parameters.size();
+    data.parameters.resize(shader_data.parameters.size());
+    for (size_t i = 0; i < shader_data.parameters.size(); ++i) {
+      auto &param = shader_data.parameters[i];
+      data.parameters[i].info = param;
+      if (i >= old_num) {
+        data.parameters[i].value = param.default_value;
+      }
+    }
+  }
+
+  data.compiled_shader = std::move(shader_data);
+  data.compiled_shader_key = std::move(result->sources_key);
+
+  if (params_changed) {
+    host.params_rescan(CLAP_PARAM_RESCAN_ALL);
+  }
+  if (editor) {
+    editor->params_changed(data.parameters);
+  }
+}
 
 void to_json(nlohmann::json &j, const Parameter &p) {
   j = {
@@ -469,10 +726,22 @@ void PatchData::deserialize(std::istream &s) {
     editor_zoom = editor_data["zoom"];
   } while (false);
 
+  frames_in_flight = obj.value("frames_in_flight", default_frames_in_flight);
+
   try {
     obj.at("parameters").get_to(parameters);
   } catch (const nlohmann::json::out_of_range &) {
   }
+
+  try {
+    auto &compiled = obj.at("compiled_shader");
+    compiled.at("key").get_to(compiled_shader_key);
+    compiled_shader = compiled.at("data").get<ShaderData>();
+  } catch (const std::exception &) {
+    // Older state, or one that can't be trusted: compile from source
+    compiled_shader = std::nullopt;
+    compiled_shader_key.clear();
+  }
 }
 
 void PatchData::serialize(std::ostream &s) {
@@ -487,7 +756,14 @@ void PatchData::serialize(std::ostream &s) {
           },
       },
       {"parameters", parameters},
+      {"frames_in_flight", frames_in_flight},
   };
+  if (compiled_shader) {
+    obj["compiled_shader"] = {
+        {"key", compiled_shader_key},
+        {"data", *compiled_shader},
+    };
+  }
   s << obj;
 }
 
@@ -498,6 +774,11 @@ bool Ogler::state_save(std::ostream &s) {
 
 bool Ogler::state_load(std::istream &s) {
   data.deserialize(s);
+  data.frames_in_flight =
+      std::clamp(data.frames_in_flight, 1, max_frames_in_flight);
+  requested_frames_in_flight = data.frames_in_flight;
+  // The host hasn't been told about the parameters in the loaded state yet
+  params_rescan_pending = true;
   if (editor) {
     editor->reload_source();
   }
@@ -505,82 +786,6 @@ bool Ogler::state_load(std::istream &s) {
   return true;
 }
 
-std::optional<std::string> Ogler::recompile_shaders() {
-  std::unique_lock<std::mutex> video_lock(video_mutex);
-  std::unique_lock<std::recursive_mutex> params_lock(params_mutex);
-
-  auto res = compile_shader({{"<preamble>", R"(#version 460
-#define OGLER_PARAMS_BINDING 0
-#define OGLER_PARAMS layout(binding = OGLER_PARAMS_BINDING) uniform Params
-
-layout (constant_id = 0) const uint ogler_gmem_size = 0;
-layout (constant_id = 1) const int ogler_version_maj = 0;
-layout (constant_id = 2) const int ogler_version_min = 0;
-layout (constant_id = 3) const int ogler_version_rev = 0;
-
-layout(local_size_x = 1, local_size_y = 1) in;
-
-layout(push_constant) uniform UniformBlock {
-  vec2 iResolution;
-  float iTime;
-  float iSampleRate;
-  float iFrameRate;
-  float iWet;
-  int ogler_num_inputs;
-};
-layout(binding = 1) uniform sampler2D iChannel[];
-layout(binding = 2, rgba8) uniform writeonly image2D oChannel;
-layout(binding = 3) buffer readonly Gmem {
-  float gmem[];
-};
-layout(binding = 4) uniform InputSizes {
-  vec2 iChannelResolution[];
-};
-layout(binding = 5) uniform sampler2D ogler_previous_frame;
-)"},
-                             {"<source>", data.video_shader},
-                             {"<epilogue>", R"(void main() {
-    vec4 fragColor;
-    mainImage(fragColor, vec2(gl_GlobalInvocationID));
-    imageStore(oChannel, ivec2(gl_GlobalInvocationID), fragColor);
-})"}},
-                            /*params_binding=*/0);
-  if (std::holds_alternative<std::string>(res)) {
-    return std::move(std::get<std::string>(res));
-  }
-
-  auto shader_data = std::move(std::get<ShaderData>(res));
-
-  size_t old_num = data.parameters.size();
-  data.parameters.resize(shader_data.parameters.size());
-  for (size_t i = 0; i < shader_data.parameters.size(); ++i) {
-    auto &param = shader_data.parameters[i];
-    data.parameters[i].info = param;
-    if (i >= old_num) {
-      data.parameters[i].value = param.default_value;
-    }
-  }
-
-  try {
-    compute = std::make_unique<Compute>(shared.vulkan, shader_data.spirv_code);
-  } catch (vk::Error &e) {
-    return e.what();
-  }
-
-  if (data.parameters.size()) {
-    params_buffer = shared.vulkan.create_buffer<float>(
-        {}, data.parameters.size(), vk::BufferUsageFlagBits::eUniformBuffer,
-        vk::SharingMode::eExclusive,
-        vk::MemoryPropertyFlagBits::eHostCoherent |
-            vk::MemoryPropertyFlagBits::eHostVisible);
-  } else {
-    params_buffer = std::nullopt;
-  }
-
-  host.params_rescan(CLAP_PARAM_RESCAN_ALL);
-  return std::nullopt;
-}
-
 static void transition_image_layout_upload(vk::raii::CommandBuffer &cmd,
                                            Image &image,
                                            vk::ImageLayout old_layout,
@@ -614,177 +819,1476 @@ static void transition_image_layout_upload(vk::raii::CommandBuffer &cmd,
 
     sourceStage = vk::PipelineStageFlagBits::eTransfer;
     destinationStage = vk::PipelineStageFlagBits::eComputeShader;
-  }
+  } else if (old_layout == vk::ImageLayout::eUndefined &&
+             new_layout == vk::ImageLayout::eGeneral) {
+    barrier.setSrcAccessMask({});
+    barrier.setDstAccessMask(vk::AccessFlagBits::eShaderWrite);
 
-  cmd.pipelineBarrier(sourceStage, destinationStage, {}, {}, {}, {barrier});
-}
+    sourceStage = vk::PipelineStageFlagBits::eTopOfPipe;
+    destinationStage = vk::PipelineStageFlagBits::eComputeShader;
+  } else if (old_layout == vk::ImageLayout::eGeneral &&
+             new_layout == vk::ImageLayout::eShaderReadOnlyOptimal) {
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite);
+    barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead);
 
-static std::span<char> get_frame_bits(IVideoFrame *frame) {
-  return std::span<char>(frame->get_bits(),
-                         frame->get_rowspan() * frame->get_h());
-}
+    sourceStage = vk::PipelineStageFlagBits::eComputeShader;
+    destinationStage = vk::PipelineStageFlagBits::eComputeShader;
+  } else if (old_layout == vk::ImageLayout::ePreinitialized &&
+             new_layout == vk::ImageLayout::eGeneral) {
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eHostWrite);
+    barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead |
+                             vk::AccessFlagBits::eShaderWrite);
 
-template <size_t pixel_size = 4>
-static void copy_image(std::span<char> src_span, std::span<char> dst_span,
-                       size_t w, size_t h, size_t src_stride,
-                       size_t dst_stride) {
-  char *src = src_span.data();
-  char *dst = dst_span.data();
-  for (size_t i = 0; i < h; ++i) {
-    std::memcpy(dst, src, w * pixel_size);
-    src += src_stride;
-    dst += dst_stride;
-  }
-}
+    sourceStage = vk::PipelineStageFlagBits::eHost;
+    destinationStage = vk::PipelineStageFlagBits::eComputeShader;
+  } else if (old_layout == vk::ImageLayout::eGeneral &&
+             new_layout == vk::ImageLayout::eGeneral) {
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite);
+    barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead);
 
-InputImage Ogler::create_input_image(int w, int h) {
-  auto img = shared.vulkan.create_image(
-      w, h, RGBAFormat, vk::ImageTiling::eOptimal,
-      vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
-  auto buf = shared.vulkan.create_buffer<char>(
-      {}, w * h * 4, vk::BufferUsageFlagBits::eTransferSrc,
-      vk::SharingMode::eExclusive,
-      vk::MemoryPropertyFlagBits::eHostVisible |
-          vk::MemoryPropertyFlagBits::eHostCoherent);
-  auto view = shared.vulkan.create_image_view(img, RGBAFormat);
+    sourceStage = vk::PipelineStageFlagBits::eComputeShader;
+    destinationStage = vk::PipelineStageFlagBits::eComputeShader;
+  }
 
-  return {
-      .image = std::move(img),
-      .transfer_buffer = std::move(buf),
-      .view = std::move(view),
-  };
+  cmd.pipelineBarrier(sourceStage, destinationStage, {}, {}, {}, {barrier});
 }
 
-void Ogler::update_frame_buffers() noexcept {
-  auto old_width = output_image.width;
-  auto old_height = output_image.height;
-
-  auto new_width = get_output_width();
-  auto new_height = get_output_height();
-
-  if (new_width != old_width || new_height != old_height) {
-    output_transfer_buffer = shared.vulkan.create_buffer<char>(
-        {}, new_width * new_height * 4, vk::BufferUsageFlagBits::eTransferDst,
-        vk::SharingMode::eExclusive,
-        vk::MemoryPropertyFlagBits::eHostVisible |
-            vk::MemoryPropertyFlagBits::eHostCoherent);
-    output_image = shared.vulkan.create_image(
-        new_width, new_height, RGBAFormat, vk::ImageTiling::eOptimal,
-        vk::ImageUsageFlagBits::eStorage |
-            vk::ImageUsageFlagBits::eTransferSrc |
-            vk::ImageUsageFlagBits::eSampled);
-    output_image_view =
-        shared.vulkan.create_image_view(output_image, RGBAFormat);
+static bool workgroup_size_supported(VulkanContext &ctx, int x, int y) {
+  auto limits = ctx.phys_device.getProperties().limits;
+  return x >= 1 && y >= 1 &&
+         static_cast<uint32_t>(x) <= limits.maxComputeWorkGroupSize[0] &&
+         static_cast<uint32_t>(y) <= limits.maxComputeWorkGroupSize[1] &&
+         static_cast<uint32_t>(x * y) <= limits.maxComputeWorkGroupInvocations;
+}
 
-    previous_image = shared.vulkan.create_image(
-        new_width, new_height, RGBAFormat, vk::ImageTiling::eOptimal,
-        vk::ImageUsageFlagBits::eStorage |
-            vk::ImageUsageFlagBits::eTransferSrc |
-            vk::ImageUsageFlagBits::eSampled);
-    previous_image_view =
-        shared.vulkan.create_image_view(previous_image, RGBAFormat);
+static constexpr std::array<std::pair<int, int>, 4> workgroup_size_candidates{
+    {
+        {8, 8},
+        {16, 16},
+        {32, 8},
+        {64, 1},
+    },
+};
 
-    one_shot_execute([&]() {
-      transition_image_layout_download(command_buffer, output_image);
-      transition_image_layout_download(command_buffer, previous_image);
-    });
+static constexpr int tuning_iterations = 4;
+
+std::unique_ptr<Ogler::Compute>
+Ogler::create_compute(const std::vector<unsigned> &spirv_code,
+                      uint64_t spirv_hash, unsigned workgroup_size_x,
+                      unsigned workgroup_size_y, uint32_t num_sets,
+                      bool store_output_image) {
+  PipelineRegistry::Key key{
+      .spirv_hash = spirv_hash,
+      .workgroup_size_x = workgroup_size_x,
+      .workgroup_size_y = workgroup_size_y,
+      .store_output_image = store_output_image,
+  };
+  auto pipeline = shared.pipelines.find(key);
+  if (!pipeline) {
+    // Built outside of the registry lock, so that compiling one shader
+    // doesn't hold up instances loading another
+    pipeline = shared.pipelines.insert(
+        key, std::make_shared<SharedPipeline>(
+                 shared.vulkan, shared.pipeline_cache, spirv_code,
+                 workgroup_size_x, workgroup_size_y, store_output_image));
   }
+  return std::make_unique<Compute>(shared.vulkan, std::move(pipeline),
+                                   num_sets);
 }
 
-IVideoFrame *Ogler::video_process_frame(std::span<const double> parms,
-                                        double project_time, double framerate,
-                                        FrameFormat force_format) noexcept {
-  std::unique_lock<std::mutex> lock(video_mutex, std::try_to_lock_t{});
-  if (!lock.owns_lock()) {
-    return nullptr;
+std::unique_ptr<Ogler::Compute>
+Ogler::create_tuned_compute(const std::vector<unsigned> &spirv_code,
+                            const RenderState &state) {
+  auto &ctx = shared.vulkan;
+  // One set per frame of the deepest ring, so that the depth can change
+  // without compiling again
+  auto num_sets = static_cast<uint32_t>(max_frames_in_flight);
+  auto spirv_hash = canonical_spirv_hash(spirv_code);
+  // Shaders that only differ in names get the same size, and so can share
+  // their pipeline
+  auto key = to_hex(spirv_hash) + '-' + ctx.device_key();
+  // The table is a file users can edit: entries the device can't run are
+  // tuned again
+  auto size = shared.workgroup_sizes.find(key);
+  if (size && workgroup_size_supported(ctx, static_cast<int>(size->first),
+                                       static_cast<int>(size->second))) {
+    return create_compute(spirv_code, spirv_hash, size->first, size->second,
+                          num_sets, state.uses_previous_frame);
   }
 
-  if (!compute) {
-    return nullptr;
+  auto timestamp_bits =
+      ctx.phys_device.getQueueFamilyProperties()[ctx.queue_family_index]
+          .timestampValidBits;
+  if (timestamp_bits == 0) {
+    return create_compute(spirv_code, spirv_hash, default_workgroup_size_x,
+                          default_workgroup_size_y, num_sets,
+                          state.uses_previous_frame);
   }
+  uint64_t timestamp_mask =
+      timestamp_bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << timestamp_bits) - 1;
+
+  // Time the candidates on a synthetic frame at the output resolution: all
+  // inputs empty, gmem left as it is. This runs on the compilation thread, so
+  // it gets its own resources rather than borrowing the ones that frames in
+  // flight are using.
+  auto output_w = get_output_width(&state);
+  auto output_h = get_output_height(&state);
+  auto tuning_pool = ctx.create_compute_command_pool();
+  auto frame = create_frame_resources(output_w, output_h, tuning_pool);
+  frame.use_staging_ring = false;
+  std::array<PooledImagePtr, 2> tuning_images{
+      create_output_image(output_w, output_h),
+      create_output_image(output_w, output_h),
+  };
+  auto tuning_input = create_input_image(1, 1);
+  auto &cmd = frame.command_buffer;
+  auto &output_image = tuning_images[0]->image;
+  one_shot_execute(cmd, frame.fence, [&]() {
+    prepare_output_images(cmd, tuning_images);
+    transition_image_layout_upload(cmd, tuning_input.image,
+                                   vk::ImageLayout::eUndefined,
+                                   vk::ImageLayout::eTransferDstOptimal);
+    transition_image_layout_upload(cmd, tuning_input.image,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   vk::ImageLayout::eShaderReadOnlyOptimal);
+  });
 
-  update_frame_buffers();
-
-  output_frame = vproc->newVideoFrame(output_image.width, output_image.height,
-                                      (int)FrameFormat::RGBA);
-  auto output_rowspan = output_frame->get_rowspan();
-  auto output_w = output_frame->get_w();
-  auto output_h = output_frame->get_h();
-  auto num_inputs = vproc->getNumInputs();
+  auto query_pool = ctx.device.createQueryPool({
+      .queryType = vk::QueryType::eTimestamp,
+      .queryCount = 2,
+  });
 
+  std::array<vk::DescriptorImageInfo, max_num_inputs> input_image_info;
+  input_image_info.fill({
+      .sampler = *sampler,
+      .imageView = *tuning_input.view,
+      .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+  });
+  std::array<std::pair<float, float>, max_num_inputs> input_resolution;
+  input_resolution.fill({1.f, 1.f});
+  std::vector<float> params;
+  for (auto &param : state.parameters) {
+    params.push_back(param.default_value);
+  }
+  stage_uniforms(frame, input_resolution, params);
+  if (state.uses_gmem) {
+    frame.gmem = shared.get_gmem(queue_index, state.gmem_first_block,
+                                 state.gmem_end_block);
+  }
   UniformsView uniforms{
       .data =
           {
               .iResolution_w = static_cast<float>(output_image.width),
               .iResolution_h = static_cast<float>(output_image.height),
-              .iTime = static_cast<float>(project_time),
-              .iSampleRate = 0,
-              .iFrameRate = static_cast<float>(framerate),
-              .iWet = static_cast<float>(parms[0]),
-              .num_inputs =
-                  std::min({static_cast<int>(max_num_inputs), num_inputs}),
+              .iWet = 1.0f,
+              .output_row_length = static_cast<unsigned>(output_image.width),
           },
   };
 
-  {
-    vk::CommandBufferBeginInfo begin_info{
-        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+  auto record_dispatch = [&](Compute &candidate) {
+    auto &pipeline = *candidate.shared;
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline.pipeline);
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                           *pipeline.pipeline_layout, 0,
+                           {*candidate.descriptor_sets[0]}, {});
+    cmd.pushConstants<float>(*pipeline.pipeline_layout,
+                             vk::ShaderStageFlagBits::eCompute, 0,
+                             uniforms.values);
+    auto group_w = pipeline.pipeline_spec_data.workgroup_size_x;
+    auto group_h = pipeline.pipeline_spec_data.workgroup_size_y;
+    cmd.dispatch((output_image.width + group_w - 1) / group_w,
+                 (output_image.height + group_h - 1) / group_h, 1);
+
+    vk::MemoryBarrier barrier{
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask =
+            vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
     };
-    command_buffer.begin(begin_info);
-  }
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eComputeShader, {},
+                        {barrier}, {}, {});
+  };
 
-  {
-    std::unique_lock<EELMutex> eel_lock(*eel_mutex);
-    auto dst = shared.gmem_transfer_buffer.map.data();
-    double **pblocks = *gmem;
-    if (pblocks) {
-      for (size_t i = 0; i < NSEEL_RAM_BLOCKS; ++i) {
-        auto buf = pblocks[i];
-        if (buf) {
-          for (size_t j = 0; j < NSEEL_RAM_ITEMSPERBLOCK; ++j) {
-            dst[i * NSEEL_RAM_ITEMSPERBLOCK + j] = buf[j];
-          }
+  std::unique_ptr<Compute> best;
+  uint64_t best_time = std::numeric_limits<uint64_t>::max();
+  for (auto [x, y] : workgroup_size_candidates) {
+    if (!workgroup_size_supported(ctx, x, y)) {
+      continue;
+    }
 
-          command_buffer.copyBuffer(
-              *shared.gmem_transfer_buffer.buffer, *shared.gmem_buffer.buffer,
-              {
-                  {
-                      .srcOffset = i * sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK,
-                      .dstOffset = i * sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK,
-                      .size = sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK,
-                  },
-              });
-        }
+    auto candidate = create_compute(spirv_code, spirv_hash, x, y, num_sets,
+                                    state.uses_previous_frame);
+    write_descriptor_set(candidate->descriptor_sets[0], state, frame,
+                         *tuning_images[0], *tuning_images[1],
+                         input_image_info);
+
+    // The first dispatch may include lazy pipeline compilation in the driver,
+    // keep it out of the measurement
+    one_shot_execute(cmd, frame.fence,
+                     [&]() { record_dispatch(*candidate); });
+    one_shot_execute(cmd, frame.fence, [&]() {
+      cmd.resetQueryPool(*query_pool, 0, 2);
+      cmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *query_pool,
+                         0);
+      for (int i = 0; i < tuning_iterations; ++i) {
+        record_dispatch(*candidate);
       }
+      cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                         *query_pool, 1);
+    });
+
+    auto [res, timestamps] = query_pool.getResults<uint64_t>(
+        0, 2, 2 * sizeof(uint64_t), sizeof(uint64_t),
+        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+    if (res != vk::Result::eSuccess) {
+      continue;
+    }
+
+    auto elapsed = (timestamps[1] - timestamps[0]) & timestamp_mask;
+    if (elapsed < best_time) {
+      best_time = elapsed;
+      best = std::move(candidate);
+    }
+  }
+
+  if (!best) {
+    return create_compute(spirv_code, spirv_hash, default_workgroup_size_x,
+                          default_workgroup_size_y, num_sets,
+                          state.uses_previous_frame);
+  }
+
+  auto &best_spec = best->shared->pipeline_spec_data;
+  shared.workgroup_sizes.insert(
+      key, {best_spec.workgroup_size_x, best_spec.workgroup_size_y});
+  return best;
+}
+
+static constexpr const char *shader_preamble = R"(#version 460
+#define OGLER_PARAMS_BINDING 0
+#define OGLER_PARAMS layout(binding = OGLER_PARAMS_BINDING) uniform Params
+
+layout (constant_id = 0) const uint ogler_gmem_size = 0;
+layout (constant_id = 1) const int ogler_version_maj = 0;
+layout (constant_id = 2) const int ogler_version_min = 0;
+layout (constant_id = 3) const int ogler_version_rev = 0;
+layout (constant_id = 6) const bool ogler_store_output_image = true;
+
+layout(local_size_x_id = 4, local_size_y_id = 5) in;
+
+layout(push_constant) uniform UniformBlock {
+  vec2 iResolution;
+  float iTime;
+  float iSampleRate;
+  float iFrameRate;
+  float iWet;
+  int ogler_num_inputs;
+  uint ogler_output_row_length;
+  uint ogler_output_offset;
+};
+layout(binding = 1) uniform sampler2D iChannel[];
+layout(binding = 2, rgba8) uniform writeonly image2D oChannel;
+layout(binding = 3) buffer readonly Gmem {
+  float gmem[];
+};
+layout(binding = 4) uniform InputSizes {
+  vec2 iChannelResolution[];
+};
+layout(binding = 5) uniform sampler2D ogler_previous_frame;
+layout(binding = 6) buffer writeonly OutputPixels {
+  uint ogler_output_pixels[];
+};
+)";
+
+static constexpr const char *shader_epilogue = R"(void main() {
+    if (any(greaterThanEqual(gl_GlobalInvocationID.xy, uvec2(iResolution)))) {
+        return;
+    }
+    vec4 fragColor;
+    mainImage(fragColor, vec2(gl_GlobalInvocationID));
+    // Only needed to sample it as ogler_previous_frame
+    if (ogler_store_output_image) {
+        imageStore(oChannel, ivec2(gl_GlobalInvocationID), fragColor);
+    }
+    // Laid out like the REAPER frame it's read back into, which is BGRA
+    uint index = ogler_output_offset +
+                 gl_GlobalInvocationID.y * ogler_output_row_length +
+                 gl_GlobalInvocationID.x;
+    ogler_output_pixels[index] = packUnorm4x8(fragColor.bgra);
+})";
+
+static constexpr unsigned spv_magic_number = 0x07230203;
+
+static std::vector<std::pair<std::string, std::string>>
+get_shader_sources(const std::string &video_shader) {
+  return {
+      {"<preamble>", shader_preamble},
+      {"<source>", video_shader},
+      {"<epilogue>", shader_epilogue},
+  };
+}
 
-      command_buffer.pipelineBarrier(
-          vk::PipelineStageFlagBits::eHost,
-          vk::PipelineStageFlagBits::eComputeShader, {}, {},
+// Identifies the output of compile_shader for the given sources. The ogler
+// version is included, since what the compiler extracts from the shader may
+// change between versions.
+static std::string
+get_shader_sources_key(const std::vector<std::pair<std::string, std::string>>
+                           &sources) {
+  auto hash = hash_bytes(std::as_bytes(std::span{
+      version::string, std::char_traits<char>::length(version::string)}));
+  for (auto &[name, source] : sources) {
+    hash = hash_bytes(std::as_bytes(std::span{source}), hash);
+  }
+  return to_hex(hash);
+}
+
+std::variant<std::shared_ptr<Ogler::RenderState>, std::string>
+Ogler::create_render_state(const ShaderData &shader_data) {
+  if (shader_data.workgroup_size_x.has_value() &&
+      !workgroup_size_supported(shared.vulkan, *shader_data.workgroup_size_x,
+                                *shader_data.workgroup_size_y)) {
+    std::stringstream errmsg;
+    errmsg << "ERROR: ogler_workgroup_size (" << *shader_data.workgroup_size_x
+           << ", " << *shader_data.workgroup_size_y
+           << ") is not supported by this device";
+    return errmsg.str();
+  }
+
+  uint64_t gmem_offset = shader_data.gmem_range_offset.value_or(0);
+  uint64_t gmem_count = shader_data.gmem_range_count.value_or(gmem_size);
+  if (gmem_count == 0 || gmem_offset + gmem_count > gmem_size) {
+    std::stringstream errmsg;
+    errmsg << "ERROR: ogler_gmem_range (" << gmem_offset << ", " << gmem_count
+           << ") must be a non-empty range within the " << gmem_size
+           << " elements of gmem";
+    return errmsg.str();
+  }
+
+  auto state = std::make_shared<RenderState>(RenderState{
+      .parameters = shader_data.parameters,
+      .output_width = shader_data.output_width,
+      .output_height = shader_data.output_height,
+      .gmem_first_block = gmem_offset / NSEEL_RAM_ITEMSPERBLOCK,
+      .gmem_end_block =
+          (gmem_offset + gmem_count + NSEEL_RAM_ITEMSPERBLOCK - 1) /
+          NSEEL_RAM_ITEMSPERBLOCK,
+      .used_inputs = shader_data.used_inputs,
+      .uses_gmem = shader_data.uses_gmem,
+      .uses_previous_frame = shader_data.uses_previous_frame,
+  });
+
+  try {
+    if (shader_data.workgroup_size_x.has_value()) {
+      state->compute = create_compute(
+          shader_data.spirv_code, canonical_spirv_hash(shader_data.spirv_code),
+          *shader_data.workgroup_size_x, *shader_data.workgroup_size_y,
+          static_cast<uint32_t>(max_frames_in_flight),
+          state->uses_previous_frame);
+    } else {
+      state->compute = create_tuned_compute(shader_data.spirv_code, *state);
+    }
+  } catch (vk::Error &e) {
+    return e.what();
+  }
+
+  return state;
+}
+
+bool Ogler::publish_compile_result(uint64_t generation, CompileResult result) {
+  std::shared_ptr<RenderState> state;
+  if (auto shader_data = std::get_if<ShaderData>(&result.data)) {
+    auto res = create_render_state(*shader_data);
+    if (std::holds_alternative<std::string>(res)) {
+      result.data = std::move(std::get<std::string>(res));
+    } else {
+      state = std::move(std::get<std::shared_ptr<RenderState>>(res));
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(compile_mutex);
+  if (generation != compile_generation) {
+    // A newer compilation was started in the meantime
+    return false;
+  }
+  if (state) {
+    pending_state.store(std::move(state));
+  }
+  compile_result = std::move(result);
+  host.request_callback();
+  return true;
+}
+
+void Ogler::run_compile(
+    uint64_t generation,
+    std::vector<std::pair<std::string, std::string>> sources,
+    std::string sources_key, std::optional<ShaderData> compiled_shader) {
+  // The embedded copy gets the instance rendering without waiting for the
+  // compiler. Project files can come from anywhere though, so the sources
+  // are still compiled once in the background, and replace the embedded
+  // copy unless they produce the very same result.
+  if (compiled_shader) {
+    CompileResult embedded{
+        .data = *compiled_shader,
+        .sources_key = sources_key,
+    };
+    if (!publish_compile_result(generation, std::move(embedded))) {
+      return;
+    }
+  }
+
+  CompileResult result{.sources_key = std::move(sources_key)};
+  // Shared with every other instance compiling the same sources
+  auto res = shared.compile_service
+                 .compile(result.sources_key, std::move(sources),
+                          /*params_binding=*/0)
+                 .get();
+  if (std::holds_alternative<std::string>(res)) {
+    result.data = std::move(std::get<std::string>(res));
+  } else {
+    auto &shader_data = std::get<ShaderData>(res);
+    if (compiled_shader &&
+        nlohmann::json(shader_data) == nlohmann::json(*compiled_shader)) {
+      return;
+    }
+    result.data = std::move(shader_data);
+  }
+  publish_compile_result(generation, std::move(result));
+}
+
+void Ogler::recompile_shaders() {
+  auto sources = get_shader_sources(data.video_shader);
+  auto sources_key = get_shader_sources_key(sources);
+
+  // SPIR-V embedded in the project state is used as long as it was produced
+  // from the very same sources, until run_compile has checked it
+  std::optional<ShaderData> compiled_shader;
+  if (data.compiled_shader && data.compiled_shader_key == sources_key &&
+      !data.compiled_shader->spirv_code.empty() &&
+      data.compiled_shader->spirv_code[0] == spv_magic_number) {
+    compiled_shader = data.compiled_shader;
+  }
+
+  std::unique_lock<std::mutex> lock(compile_mutex);
+  std::erase_if(compile_tasks, [](std::future<void> &task) {
+    return task.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  });
+  compile_tasks.push_back(std::async(
+      std::launch::async, &Ogler::run_compile, this, ++compile_generation,
+      std::move(sources), std::move(sources_key), std::move(compiled_shader)));
+}
+
+// YV12 frames are a Y plane followed by V and U planes of half the height
+// and rowspan
+static YuvLayout get_yv12_layout(IVideoFrame *frame, uint32_t offset) {
+  auto w = static_cast<uint32_t>(frame->get_w());
+  auto h = static_cast<uint32_t>(frame->get_h());
+  auto rowspan = static_cast<uint32_t>(frame->get_rowspan());
+  return {
+      .width = w,
+      .height = h,
+      .offset = offset,
+      .rowspan = rowspan,
+      .chroma_rowspan = rowspan / 2,
+      .v_offset = offset + rowspan * h,
+      .u_offset = offset + rowspan * h + (rowspan / 2) * (h / 2),
+  };
+}
+
+static YuvLayout get_yuv_layout(IVideoFrame *frame, uint32_t offset) {
+  if (frame->get_fmt() == (int)FrameFormat::YV12) {
+    return get_yv12_layout(frame, offset);
+  }
+  return {
+      .width = static_cast<uint32_t>(frame->get_w()),
+      .height = static_cast<uint32_t>(frame->get_h()),
+      .offset = offset,
+      .rowspan = static_cast<uint32_t>(frame->get_rowspan()),
+  };
+}
+
+// Tightest layout YuvConverter::record_encode can write
+static YuvLayout get_packed_yuv_layout(FrameFormat format, uint32_t w,
+                                       uint32_t h) {
+  if (format == FrameFormat::YV12) {
+    auto rowspan = (w + 7) & ~uint32_t(7);
+    return {
+        .width = w,
+        .height = h,
+        .offset = 0,
+        .rowspan = rowspan,
+        .chroma_rowspan = rowspan / 2,
+        .v_offset = rowspan * h,
+        .u_offset = rowspan * h + (rowspan / 2) * (h / 2),
+    };
+  }
+  return {
+      .width = w,
+      .height = h,
+      .offset = 0,
+      .rowspan = ((w + 1) & ~uint32_t(1)) * 2,
+  };
+}
+
+static void create_yuv_descriptor_sets(FrameResources &frame,
+                                       YuvConverter &converter) {
+  if (frame.yuv_descriptor_pool) {
+    return;
+  }
+  frame.yuv_descriptor_pool =
+      converter.create_descriptor_pool(max_num_inputs + 1);
+  frame.yuv_descriptor_sets = converter.create_decode_descriptor_sets(
+      *frame.yuv_descriptor_pool, max_num_inputs);
+  frame.yuv_encode_descriptor_sets =
+      converter.create_encode_descriptor_sets(*frame.yuv_descriptor_pool, 1);
+}
+
+static std::span<char> get_frame_bits(IVideoFrame *frame) {
+  size_t size = frame->get_rowspan() * frame->get_h();
+  if (frame->get_fmt() == (int)FrameFormat::YV12) {
+    auto layout = get_yv12_layout(frame, 0);
+    size = layout.u_offset + layout.chroma_rowspan * (layout.height / 2);
+  }
+  return std::span<char>(frame->get_bits(), size);
+}
+
+// Identifies an input frame by its contents. The padding at the end of RGBA
+// rows is ignored, YUV frames are hashed whole.
+static uint64_t hash_frame(IVideoFrame *frame) {
+  auto bits = get_frame_bits(frame);
+  size_t w = frame->get_w();
+  size_t h = frame->get_h();
+  size_t rowspan = frame->get_rowspan();
+  auto format = frame->get_fmt();
+  bool is_rgba = format == (int)FrameFormat::RGBA;
+  auto row_bytes = is_rgba ? w * 4 : bits.size();
+  auto num_rows = is_rgba ? h : 1;
+  auto row_words = row_bytes / sizeof(uint64_t);
+  std::array<uint64_t, 3> dims{w, h, static_cast<uint64_t>(format)};
+  auto hash = hash_span(std::span{dims});
+  for (size_t y = 0; y < num_rows; ++y) {
+    auto row = bits.subspan(y * rowspan, row_bytes);
+    std::array<uint64_t, 2> row_hash{
+        hash,
+        hash_words(std::span{reinterpret_cast<const uint64_t *>(row.data()),
+                             row_words}),
+    };
+    hash = hash_span(std::span{row_hash});
+    if (row_bytes % sizeof(uint64_t)) {
+      hash = hash_bytes(
+          std::as_bytes(row.subspan(row_words * sizeof(uint64_t))), hash);
+    }
+  }
+  return hash;
+}
+
+void FrameHandoff::publish(const void *producer, IVideoFrame *frame,
+                           std::shared_ptr<CachedInput> image) {
+  auto hash = hash_frame(frame);
+  std::unique_lock<std::mutex> lock(mutex);
+  std::erase_if(entries,
+                [](auto &entry) { return entry.second.image.expired(); });
+  entries[frame->get_bits()] = {
+      .producer = producer,
+      .hash = hash,
+      .width = frame->get_w(),
+      .height = frame->get_h(),
+      .image = image,
+  };
+}
+
+std::shared_ptr<CachedInput> FrameHandoff::find(IVideoFrame *frame,
+                                                uint64_t hash) {
+  if (frame->get_fmt() != (int)FrameFormat::RGBA) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = entries.find(frame->get_bits());
+  if (it == entries.end()) {
+    return nullptr;
+  }
+  auto &entry = it->second;
+  auto image = entry.image.lock();
+  if (!image || entry.width != frame->get_w() ||
+      entry.height != frame->get_h() ||
+      entry.hash != hash) {
+    entries.erase(it);
+    return nullptr;
+  }
+  consumed.insert(entry.producer);
+  return image;
+}
+
+void FrameHandoff::forget(const CachedInput *image) {
+  if (!image) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  std::erase_if(entries, [&](auto &entry) {
+    return entry.second.image.lock().get() == image;
+  });
+}
+
+bool FrameHandoff::take_consumed(const void *producer) {
+  std::unique_lock<std::mutex> lock(mutex);
+  return consumed.erase(producer) > 0;
+}
+
+template <size_t pixel_size = 4>
+static void copy_image(std::span<char> src_span, std::span<char> dst_span,
+                       size_t w, size_t h, size_t src_stride,
+                       size_t dst_stride) {
+  char *src = src_span.data();
+  char *dst = dst_span.data();
+  if (src_stride == w * pixel_size && dst_stride == src_stride) {
+    std::memcpy(dst, src, h * src_stride);
+    return;
+  }
+  for (size_t i = 0; i < h; ++i) {
+    std::memcpy(dst, src, w * pixel_size);
+    src += src_stride;
+    dst += dst_stride;
+  }
+}
+
+// Copies the output of a frame from its own buffer into the frame handed
+// back to REAPER, plane by plane
+static void copy_output(FrameResources &frame, IVideoFrame *dst) {
+  auto src_bits = frame.output_buffer->map;
+  auto dst_bits = get_frame_bits(dst);
+  size_t w = frame.output_width;
+  size_t h = frame.output_height;
+  auto &src_layout = frame.output_layout;
+  switch (frame.output_format) {
+  case FrameFormat::YV12: {
+    auto dst_layout = get_yuv_layout(dst, 0);
+    copy_image<1>(src_bits, dst_bits, w, h, src_layout.rowspan,
+                  dst_layout.rowspan);
+    copy_image<1>(src_bits.subspan(src_layout.v_offset),
+                  dst_bits.subspan(dst_layout.v_offset), (w + 1) / 2, h / 2,
+                  src_layout.chroma_rowspan, dst_layout.chroma_rowspan);
+    copy_image<1>(src_bits.subspan(src_layout.u_offset),
+                  dst_bits.subspan(dst_layout.u_offset), (w + 1) / 2, h / 2,
+                  src_layout.chroma_rowspan, dst_layout.chroma_rowspan);
+    break;
+  }
+  case FrameFormat::YUY2:
+    copy_image<2>(src_bits, dst_bits, w, h, src_layout.rowspan,
+                  dst->get_rowspan());
+    break;
+  default:
+    copy_image(src_bits, dst_bits, w, h, w * 4, dst->get_rowspan());
+    break;
+  }
+}
+
+InputImage Ogler::create_input_image(int w, int h) {
+  auto img = shared.vulkan.create_image(
+      w, h, RGBAFormat, vk::ImageTiling::eOptimal,
+      vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
+  auto buf = shared.vulkan.create_buffer<char>(
+      {}, w * h * 4, vk::BufferUsageFlagBits::eTransferSrc,
+      vk::SharingMode::eExclusive,
+      vk::MemoryPropertyFlagBits::eHostVisible |
+          vk::MemoryPropertyFlagBits::eHostCoherent);
+  auto view = shared.vulkan.create_image_view(img, RGBAFormat);
+
+  return {
+      .image = std::move(img),
+      .transfer_buffer = std::move(buf),
+      .view = std::move(view),
+  };
+}
+
+std::shared_ptr<CachedInput> Ogler::create_cached_input(int w, int h) {
+  auto usage = vk::ImageUsageFlagBits::eSampled |
+               vk::ImageUsageFlagBits::eStorage;
+  if (shared.vulkan.unified_memory) {
+    if (auto mapped = shared.vulkan.create_mapped_image(w, h, RGBAFormat,
+                                                        usage)) {
+      auto view = shared.vulkan.create_image_view(mapped->image, RGBAFormat);
+      one_shot_execute([&]() {
+        transition_image_layout_upload(command_buffer, mapped->image,
+                                       vk::ImageLayout::ePreinitialized,
+                                       vk::ImageLayout::eGeneral);
+      });
+      return std::make_shared<CachedInput>(CachedInput{
+          .image = std::move(mapped->image),
+          .view = std::move(view),
+          .map = mapped->map,
+          .row_pitch = mapped->row_pitch,
+      });
+    }
+  }
+
+  // Storage, for YUV frames that are converted on the GPU
+  auto img = shared.vulkan.create_image(
+      w, h, RGBAFormat, vk::ImageTiling::eOptimal,
+      vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled |
+          vk::ImageUsageFlagBits::eStorage);
+  auto view = shared.vulkan.create_image_view(img, RGBAFormat);
+
+  return std::make_shared<CachedInput>(CachedInput{
+      .image = std::move(img),
+      .view = std::move(view),
+  });
+}
+
+PooledImagePtr Ogler::create_output_image(int w, int h) {
+  return shared.resource_pool.acquire_image(
+      RGBAFormat, w, h,
+      vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc |
+          vk::ImageUsageFlagBits::eTransferDst |
+          vk::ImageUsageFlagBits::eSampled);
+}
+
+FrameResources
+Ogler::create_frame_resources(int output_w, int output_h,
+                              vk::raii::CommandPool &command_pool) {
+  // The CPU reads the whole output back, which is much faster from cached
+  // memory
+  vk::MemoryPropertyFlags readback_memory =
+      vk::MemoryPropertyFlagBits::eHostCached;
+  if (shared.vulkan.unified_memory) {
+    readback_memory |= vk::MemoryPropertyFlagBits::eDeviceLocal;
+  }
+
+  // Also large enough for any YUV layout from get_packed_yuv_layout
+  auto output_buffer_size =
+      std::max(output_w * 4, ((output_w + 7) & ~7) * 2) * output_h;
+
+  return {
+      .command_buffer = shared.vulkan.create_command_buffer(command_pool),
+      .fence = shared.vulkan.create_fence(),
+      .output_buffer = shared.resource_pool.acquire_buffer(
+          output_buffer_size, vk::BufferUsageFlagBits::eStorageBuffer,
+          vk::MemoryPropertyFlagBits::eHostVisible |
+              vk::MemoryPropertyFlagBits::eHostCoherent,
+          readback_memory),
+      .output_width = output_w,
+      .output_height = output_h,
+  };
+}
+
+void Ogler::create_output_images(int w, int h) {
+  // The output images only exist to be sampled as ogler_previous_frame, the
+  // output itself is written to a buffer. Shaders that never sample it don't
+  // write them either, so a single one is enough to bind.
+  bool keep_previous = !render_state || render_state->uses_previous_frame;
+  auto num_images = keep_previous ? frames.size() + 1 : 1;
+  // Back to the pool first, in case the size didn't change
+  output_images.clear();
+  for (size_t i = 0; i < num_images; ++i) {
+    output_images.push_back(create_output_image(w, h));
+  }
+
+  // Every frame samples empty_input for unbound inputs, so it is only laid
+  // out here, while no frame is in flight
+  one_shot_execute([&]() {
+    prepare_output_images(command_buffer, output_images);
+    transition_image_layout_upload(command_buffer, empty_input.image,
+                                   vk::ImageLayout::eUndefined,
+                                   vk::ImageLayout::eTransferDstOptimal);
+    transition_image_layout_upload(command_buffer, empty_input.image,
+                                   vk::ImageLayout::eTransferDstOptimal,
+                                   vk::ImageLayout::eShaderReadOnlyOptimal);
+  });
+}
+
+void Ogler::prepare_output_images(vk::raii::CommandBuffer &cmd,
+                                  std::span<PooledImagePtr> images) {
+  // Images that come from the pool still hold the last frame of their
+  // previous owner, which would show up as its ogler_previous_frame. New
+  // ones are undefined, so every image is cleared.
+  vk::ImageSubresourceRange range{
+      .aspectMask = vk::ImageAspectFlagBits::eColor,
+      .levelCount = 1,
+      .layerCount = 1,
+  };
+  std::vector<vk::ImageMemoryBarrier> before_clear;
+  std::vector<vk::ImageMemoryBarrier> after_clear;
+  for (auto &image : images) {
+    before_clear.push_back({
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .oldLayout = image->layout,
+        .newLayout = vk::ImageLayout::eGeneral,
+        .image = *image->image.image,
+        .subresourceRange = range,
+    });
+    after_clear.push_back({
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead |
+                         vk::AccessFlagBits::eShaderWrite |
+                         vk::AccessFlagBits::eTransferRead,
+        .oldLayout = vk::ImageLayout::eGeneral,
+        .newLayout = vk::ImageLayout::eGeneral,
+        .image = *image->image.image,
+        .subresourceRange = range,
+    });
+  }
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader |
+                          vk::PipelineStageFlagBits::eTransfer,
+                      vk::PipelineStageFlagBits::eTransfer, {}, {}, {},
+                      before_clear);
+  for (auto &image : images) {
+    cmd.clearColorImage(*image->image.image, vk::ImageLayout::eGeneral,
+                        vk::ClearColorValue{std::array{0.f, 0.f, 0.f, 0.f}},
+                        {range});
+    image->layout = vk::ImageLayout::eGeneral;
+  }
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                      vk::PipelineStageFlagBits::eComputeShader |
+                          vk::PipelineStageFlagBits::eTransfer,
+                      {}, {}, {}, after_clear);
+}
+
+void Ogler::create_frames(size_t num_frames) {
+  drain_frames();
+
+  auto w = get_output_width(render_state.get());
+  auto h = get_output_height(render_state.get());
+
+  frames.clear();
+  for (size_t i = 0; i < num_frames; ++i) {
+    frames.push_back(
+        create_frame_resources(w, h, command_pool));
+  }
+  frame_index = 0;
+  create_output_images(w, h);
+}
+
+void Ogler::upload_input(FrameResources &frame, size_t index,
+                         CachedInput &input, IVideoFrame *source) {
+  auto w = input.image.width;
+  auto h = input.image.height;
+  auto bits = get_frame_bits(source);
+  auto rowspan = static_cast<size_t>(source->get_rowspan());
+  auto format = static_cast<FrameFormat>(source->get_fmt());
+  bool is_rgba = format == FrameFormat::RGBA;
+  bool mapped = !input.map.empty();
+
+  if (mapped && is_rgba) {
+    // The GPU sees the host writes once the frame is submitted
+    copy_image(bits, input.map, w, h, rowspan, input.row_pitch);
+    return;
+  }
+
+  // Copies from RGBA frames address texels, so both the start of the frame
+  // and its rows must be aligned to them. YUV frames are read byte by byte.
+  std::shared_ptr<HostBuffer> host_buffer;
+  if (bits.size() >= min_host_import_size &&
+      (!is_rgba || (rowspan % 4 == 0 &&
+                    reinterpret_cast<uintptr_t>(bits.data()) % 4 == 0))) {
+    host_buffer = shared.host_imports.import(
+        bits, is_rgba ? vk::BufferUsageFlagBits::eTransferSrc
+                      : vk::BufferUsageFlagBits::eStorageBuffer);
+  }
+
+  vk::Buffer src_buffer;
+  vk::DeviceSize src_offset = 0;
+  uint32_t src_row_length = 0;
+  if (host_buffer) {
+    src_buffer = *host_buffer->buffer;
+    src_offset = host_buffer->offset;
+    src_row_length = static_cast<uint32_t>(rowspan / 4);
+    source->AddRef();
+    frame.imported_inputs.push_back({
+        .frame = std::unique_ptr<IVideoFrame, VideoFrameRelease>(source),
+        .buffer = std::move(host_buffer),
+    });
+  } else {
+    // RGBA frames are packed, YUV ones are copied whole and rounded up to
+    // the words the conversion shader reads
+    auto staging = stage(frame, is_rgba ? size_t(w) * h * 4
+                                        : (bits.size() + 3) & ~size_t(3));
+    if (is_rgba) {
+      copy_image(bits, staging.map, w, h, rowspan, w * 4);
+    } else {
+      std::memcpy(staging.map.data(), bits.data(), bits.size());
+    }
+    src_buffer = staging.buffer;
+    src_offset = staging.offset;
+  }
+
+  auto &cmd = frame.command_buffer;
+  if (!is_rgba) {
+    auto converter = shared.get_yuv_converter();
+    create_yuv_descriptor_sets(frame, *converter);
+    auto layout = get_yuv_layout(source, static_cast<uint32_t>(src_offset));
+
+    if (!mapped) {
+      transition_image_layout_upload(cmd, input.image,
+                                     vk::ImageLayout::eUndefined,
+                                     vk::ImageLayout::eGeneral);
+    }
+    converter->record_decode(
+        cmd, frame.yuv_descriptor_sets[index],
+        format == FrameFormat::YV12 ? YuvFormat::YV12 : YuvFormat::YUY2,
+        src_buffer, layout, *input.view);
+    transition_image_layout_upload(cmd, input.image, vk::ImageLayout::eGeneral,
+                                   input.layout());
+    return;
+  }
+
+  transition_image_layout_upload(cmd, input.image, vk::ImageLayout::eUndefined,
+                                 vk::ImageLayout::eTransferDstOptimal);
+
+  vk::BufferImageCopy region{
+      .bufferOffset = src_offset,
+      .bufferRowLength = src_row_length,
+      .bufferImageHeight = 0,
+      .imageSubresource =
+          {
+              .aspectMask = vk::ImageAspectFlagBits::eColor,
+              .layerCount = 1,
+          },
+      .imageExtent =
           {
-              vk::BufferMemoryBarrier{
-                  .srcAccessMask = vk::AccessFlagBits::eHostWrite,
-                  .dstAccessMask = vk::AccessFlagBits::eShaderRead,
-                  .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                  .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-                  .buffer = *shared.gmem_buffer.buffer,
-                  .size = VK_WHOLE_SIZE,
-              },
+              .width = static_cast<uint32_t>(w),
+              .height = static_cast<uint32_t>(h),
+              .depth = 1,
           },
-          {});
+  };
+  cmd.copyBufferToImage(src_buffer, *input.image.image,
+                        vk::ImageLayout::eTransferDstOptimal, {region});
+
+  transition_image_layout_upload(cmd, input.image,
+                                 vk::ImageLayout::eTransferDstOptimal,
+                                 vk::ImageLayout::eShaderReadOnlyOptimal);
+}
+
+StagingRange Ogler::stage(FrameResources &frame, size_t size) {
+  if (frame.use_staging_ring) {
+    if (auto range = shared.staging_ring.allocate(size)) {
+      frame.staging_ranges.push_back(range->id);
+      return *range;
     }
   }
+  // Rounded up, so that the pool can hand the same buffers out again when
+  // the sizes vary from frame to frame
+  auto buffer_size = std::bit_ceil(std::max(size, min_staging_overflow_size));
+  auto &buffer =
+      frame.staging_overflow.emplace_back(shared.resource_pool.acquire_buffer(
+          static_cast<int>(buffer_size), StagingRing::usage,
+          vk::MemoryPropertyFlagBits::eHostVisible |
+              vk::MemoryPropertyFlagBits::eHostCoherent));
+  return {
+      .buffer = *buffer->buffer,
+      .offset = 0,
+      .map = buffer->map.first(size),
+  };
+}
+
+void Ogler::stage_uniforms(FrameResources &frame,
+                           std::span<const std::pair<float, float>> resolutions,
+                           std::span<const float> params) {
+  frame.input_resolutions = stage(frame, resolutions.size_bytes());
+  std::memcpy(frame.input_resolutions.map.data(), resolutions.data(),
+              resolutions.size_bytes());
+  frame.params.reset();
+  if (!params.empty()) {
+    frame.params = stage(frame, params.size_bytes());
+    std::memcpy(frame.params->map.data(), params.data(), params.size_bytes());
+  }
+}
+
+void Ogler::record_handoff(FrameResources &frame, uint32_t row_length,
+                           uint32_t offset) {
+  auto &cmd = frame.command_buffer;
+  auto &handoff = frame.handoff_image;
+  // Instances that found the previous output may still be reading it, in
+  // which case it's left to them
+  shared.frame_handoff.forget(handoff.get());
+  if (!handoff || handoff.use_count() > 1) {
+    std::shared_ptr<PooledImage> pooled = shared.resource_pool.acquire_image(
+        RGBAFormat, frame.output_width, frame.output_height,
+        vk::ImageUsageFlagBits::eTransferDst |
+            vk::ImageUsageFlagBits::eSampled);
+    // The image goes back to the pool once neither this frame nor any
+    // downstream instance holds it
+    handoff = std::shared_ptr<CachedInput>(
+        new CachedInput{
+            .image = std::move(pooled->image),
+            .view = std::move(pooled->view),
+        },
+        [pooled](CachedInput *input) mutable {
+          pooled->image = std::move(input->image);
+          pooled->view = std::move(input->view);
+          pooled->layout = vk::ImageLayout::eShaderReadOnlyOptimal;
+          delete input;
+          pooled.reset();
+        });
+  }
 
-  transition_image_layout_upload(command_buffer, empty_input.image,
+  auto output_pixels = frame.imported_output ? *frame.imported_output->buffer
+                                             : *frame.output_buffer->buffer;
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                      vk::PipelineStageFlagBits::eTransfer, {}, {},
+                      {
+                          vk::BufferMemoryBarrier{
+                              .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                              .dstAccessMask =
+                                  vk::AccessFlagBits::eTransferRead,
+                              .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                              .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                              .buffer = output_pixels,
+                              .size = VK_WHOLE_SIZE,
+                          },
+                      },
+                      {});
+  transition_image_layout_upload(cmd, handoff->image,
                                  vk::ImageLayout::eUndefined,
                                  vk::ImageLayout::eTransferDstOptimal);
-  transition_image_layout_upload(command_buffer, empty_input.image,
+  vk::BufferImageCopy region{
+      .bufferOffset = vk::DeviceSize(offset) * 4,
+      .bufferRowLength = row_length,
+      .bufferImageHeight = 0,
+      .imageSubresource =
+          {
+              .aspectMask = vk::ImageAspectFlagBits::eColor,
+              .layerCount = 1,
+          },
+      .imageExtent =
+          {
+              .width = static_cast<uint32_t>(frame.output_width),
+              .height = static_cast<uint32_t>(frame.output_height),
+              .depth = 1,
+          },
+  };
+  cmd.copyBufferToImage(output_pixels, *handoff->image.image,
+                        vk::ImageLayout::eTransferDstOptimal, {region});
+  transition_image_layout_upload(cmd, handoff->image,
                                  vk::ImageLayout::eTransferDstOptimal,
                                  vk::ImageLayout::eShaderReadOnlyOptimal);
+}
+
+void Ogler::retire_frame(FrameResources &frame) {
+  shared.scheduler.wait(queue_index, frame.submit_serial, *frame.fence);
+  shared.vulkan.device.resetFences({*frame.fence});
+  frame.command_buffer.reset();
+  shared.staging_ring.release(frame.staging_ranges);
+  frame.staging_ranges.clear();
+  frame.staging_overflow.clear();
+  frame.input_images.clear();
+  frame.imported_inputs.clear();
+  frame.imported_output.reset();
+  frame.output_target = nullptr;
+  frame.gmem.reset();
+  frame.submitted = false;
+}
+
+void Ogler::drain_frames() {
+  for (auto &frame : frames) {
+    if (frame.submitted) {
+      retire_frame(frame);
+    }
+  }
+}
+
+void Ogler::apply_render_state(std::shared_ptr<RenderState> state) {
+  // Frames in flight still use the descriptor sets of the old pipeline, and
+  // the ring is rebuilt for the new parameter count
+  drain_frames();
+  render_state = std::move(state);
+  create_frames(requested_frames_in_flight);
+}
+
+void Ogler::update_frame_buffers() noexcept {
+  auto &current = output_images.front()->image;
+  size_t num_frames = requested_frames_in_flight;
+  if (get_output_width(render_state.get()) != current.width ||
+      get_output_height(render_state.get()) != current.height ||
+      num_frames != frames.size()) {
+    create_frames(num_frames);
+  }
+}
+
+void Ogler::write_descriptor_set(
+    vk::raii::DescriptorSet &descriptor_set, const RenderState &state,
+    FrameResources &frame, PooledImage &output, PooledImage &previous,
+    std::span<const vk::DescriptorImageInfo> input_image_info) {
+  vk::DescriptorImageInfo output_image_info{
+      .sampler = *sampler,
+      .imageView = *output.view,
+      .imageLayout = vk::ImageLayout::eGeneral,
+  };
+  // Shaders index gmem from the start of the first block of their range, see
+  // GmemRebaser
+  constexpr auto block_bytes = sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK;
+  vk::DescriptorBufferInfo gmem_buffer_info{};
+  if (frame.gmem) {
+    gmem_buffer_info = {
+        .buffer = *frame.gmem->buffer.buffer,
+        .offset = (state.gmem_first_block - frame.gmem->first_block) *
+                  block_bytes,
+        .range = (state.gmem_end_block - state.gmem_first_block) * block_bytes,
+    };
+  }
+  vk::DescriptorBufferInfo input_resolution_info{
+      .buffer = frame.input_resolutions.buffer,
+      .offset = frame.input_resolutions.offset,
+      .range = frame.input_resolutions.map.size(),
+  };
+  vk::DescriptorImageInfo previous_frame_info{
+      .sampler = *sampler,
+      .imageView = *previous.view,
+      .imageLayout = vk::ImageLayout::eGeneral,
+  };
+  vk::Buffer output_pixels = *frame.output_buffer->buffer;
+  if (frame.output_format != FrameFormat::RGBA) {
+    output_pixels = *frame.yuv_encode_buffer->buffer;
+  } else if (frame.imported_output) {
+    output_pixels = *frame.imported_output->buffer;
+  }
+  vk::DescriptorBufferInfo output_pixels_info{
+      .buffer = output_pixels,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE,
+  };
+
+  std ::vector<vk::WriteDescriptorSet> write_descriptor_sets = {
+      // Input texture
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 1,
+          .descriptorCount = static_cast<uint32_t>(input_image_info.size()),
+          .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+          .pImageInfo = input_image_info.data(),
+      },
+      // Output texture
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 2,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageImage,
+          .pImageInfo = &output_image_info,
+      },
+      // iChannelResolution[]
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 4,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eUniformBuffer,
+          .pBufferInfo = &input_resolution_info,
+      },
+      // ogler_previous_frame
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 5,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+          .pImageInfo = &previous_frame_info,
+      },
+      // ogler_output_pixels
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 6,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageBuffer,
+          .pBufferInfo = &output_pixels_info,
+      },
+  };
+
+  // Left unwritten for shaders that never read gmem
+  if (frame.gmem) {
+    write_descriptor_sets.push_back({
+        .dstSet = *descriptor_set,
+        .dstBinding = 3,
+        .descriptorCount = 1,
+        .descriptorType = vk::DescriptorType::eStorageBuffer,
+        .pBufferInfo = &gmem_buffer_info,
+    });
+  }
+
+  vk::DescriptorBufferInfo uniforms_info{};
+  if (frame.params) {
+    uniforms_info.buffer = frame.params->buffer;
+    uniforms_info.offset = frame.params->offset;
+    uniforms_info.range = frame.params->map.size();
+    write_descriptor_sets.push_back({
+        .dstSet = *descriptor_set,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = vk::DescriptorType::eUniformBuffer,
+        .pBufferInfo = &uniforms_info,
+    });
+  }
+
+  shared.vulkan.device.updateDescriptorSets(write_descriptor_sets, {});
+}
+
+// Below this, splitting the conversion across threads costs more than it saves
+static constexpr size_t parallel_gmem_convert_blocks = 16;
+
+void Ogler::publish_gmem_uploads(FrameResources &frame) {
+  if (frame.gmem_uploads.empty()) {
+    return;
+  }
+  std::unique_lock<std::mutex> hashes_lock(frame.gmem->hashes_mutex);
+  for (auto [i, hash] : frame.gmem_uploads) {
+    auto &block = frame.gmem->blocks[i];
+    --block.pending;
+    // Submissions to a queue run in serial order, so the latest one decides
+    // what the buffer holds
+    if (frame.submit_serial > block.serial) {
+      block.hash = hash;
+      block.serial = frame.submit_serial;
+    }
+  }
+  frame.gmem_uploads.clear();
+}
+
+void Ogler::record_gmem_upload(FrameResources &frame) {
+  auto &cmd = frame.command_buffer;
+  constexpr auto block_bytes = sizeof(float) * NSEEL_RAM_ITEMSPERBLOCK;
+
+  std::unique_lock<EELMutex> eel_lock(*eel_mutex);
+  double **pblocks = *gmem;
+  if (!pblocks) {
+    return;
+  }
+
+  // Only blocks that changed since they were last uploaded (by any instance
+  // on the same queue, since they share the buffer) are converted, packed one
+  // after the other in staging. An upload only counts once it's submitted,
+  // since that's what orders it before this frame.
+  auto &shared_gmem = *frame.gmem;
+  std::vector<size_t> dirty_blocks;
+  {
+    std::unique_lock<std::mutex> hashes_lock(shared_gmem.hashes_mutex);
+    for (size_t i = render_state->gmem_first_block;
+         i < render_state->gmem_end_block; ++i) {
+      auto buf = pblocks[i];
+      if (!buf) {
+        continue;
+      }
+
+      auto hash = hash_words(std::span{
+          reinterpret_cast<const uint64_t *>(buf), NSEEL_RAM_ITEMSPERBLOCK});
+      auto &block = shared_gmem.blocks[i];
+      if (block.pending == 0 && block.hash == hash) {
+        continue;
+      }
+      ++block.pending;
+      frame.gmem_uploads.emplace_back(i, hash);
+      dirty_blocks.push_back(i);
+    }
+  }
+
+  if (dirty_blocks.empty()) {
+    return;
+  }
+
+  auto staging = stage(frame, dirty_blocks.size() * block_bytes);
+  auto staging_floats = reinterpret_cast<float *>(staging.map.data());
+  // Runs of adjacent blocks are copied with a single region
+  std::vector<vk::BufferCopy> regions;
+  for (size_t k = 0; k < dirty_blocks.size(); ++k) {
+    auto offset = (dirty_blocks[k] - shared_gmem.first_block) * block_bytes;
+    if (!regions.empty() &&
+        regions.back().dstOffset + regions.back().size == offset) {
+      regions.back().size += block_bytes;
+    } else {
+      regions.push_back({
+          .srcOffset = staging.offset + k * block_bytes,
+          .dstOffset = offset,
+          .size = block_bytes,
+      });
+    }
+  }
+
+  auto convert_block = [&](const size_t &i) {
+    auto k = &i - dirty_blocks.data();
+    convert_to_float(
+        std::span<const double>{pblocks[i], NSEEL_RAM_ITEMSPERBLOCK},
+        std::span<float>{staging_floats + k * NSEEL_RAM_ITEMSPERBLOCK,
+                         NSEEL_RAM_ITEMSPERBLOCK});
+  };
+  if (dirty_blocks.size() >= parallel_gmem_convert_blocks) {
+    std::for_each(std::execution::par, dirty_blocks.begin(),
+                  dirty_blocks.end(), convert_block);
+  } else {
+    std::for_each(dirty_blocks.begin(), dirty_blocks.end(), convert_block);
+  }
+
+  cmd.copyBuffer(staging.buffer, *shared_gmem.buffer.buffer, regions);
+  cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                      vk::PipelineStageFlagBits::eComputeShader, {}, {},
+                      {
+                          vk::BufferMemoryBarrier{
+                              .srcAccessMask =
+                                  vk::AccessFlagBits::eTransferWrite,
+                              .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+                              .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                              .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                              .buffer = *shared_gmem.buffer.buffer,
+                              .size = VK_WHOLE_SIZE,
+                          },
+                      },
+                      {});
+}
+
+IVideoFrame *Ogler::video_process_frame(std::span<const double> parms,
+                                        double project_time, double framerate,
+                                        FrameFormat force_format) noexcept {
+  std::unique_lock<std::mutex> lock(video_mutex, std::try_to_lock_t{});
+  if (!lock.owns_lock()) {
+    return nullptr;
+  }
+
+  if (auto next = pending_state.exchange(nullptr)) {
+    apply_render_state(std::move(next));
+  }
+
+  if (!render_state) {
+    return nullptr;
+  }
+
+  update_frame_buffers();
+
+  auto &compute = *render_state->compute;
+  auto frame_slot = frame_index % frames.size();
+  auto image_index = frame_index % output_images.size();
+  auto &frame = frames[frame_slot];
+  auto &output = *output_images[image_index];
+  auto &previous = *output_images[(image_index + output_images.size() - 1) %
+                                  output_images.size()];
+  auto &output_image = output.image;
+  auto &cmd = frame.command_buffer;
+  if (frame.submitted) {
+    retire_frame(frame);
+  }
+
+  auto num_inputs = vproc->getNumInputs();
+
+  // YUV output is encoded on the GPU, after the shader has run
+  auto converter = shared.get_yuv_converter();
+  frame.output_format = FrameFormat::RGBA;
+  if (converter && (force_format == FrameFormat::YV12 ||
+                    force_format == FrameFormat::YUY2)) {
+    frame.output_format = force_format;
+  }
+  bool encode_yuv = frame.output_format != FrameFormat::RGBA;
+  auto yuv_format = frame.output_format == FrameFormat::YV12 ? YuvFormat::YV12
+                                                             : YuvFormat::YUY2;
+  frame.output_layout =
+      get_packed_yuv_layout(frame.output_format, frame.output_width,
+                            frame.output_height);
+
+  // With a single frame in flight, the frame handed back to REAPER is known
+  // up front: if possible, the output is written straight into its memory
+  unsigned output_row_length = frame.output_width;
+  unsigned output_offset = 0;
+  if (frames.size() == 1) {
+    frame.output_target =
+        vproc->newVideoFrame(frame.output_width, frame.output_height,
+                             (int)frame.output_format);
+  }
+  if (frame.output_target) {
+    auto output_bits = get_frame_bits(frame.output_target);
+    auto output_rowspan = frame.output_target->get_rowspan();
+    // RGBA pixels are written as words, YUV ones are checked below
+    bool aligned = output_rowspan % 4 == 0 &&
+                   reinterpret_cast<uintptr_t>(output_bits.data()) % 4 == 0;
+    if (output_bits.size() >= min_host_import_size &&
+        (encode_yuv || aligned)) {
+      frame.imported_output = shared.host_imports.import(
+          output_bits, vk::BufferUsageFlagBits::eStorageBuffer);
+    }
+    if (frame.imported_output && encode_yuv) {
+      auto layout = get_yuv_layout(
+          frame.output_target,
+          static_cast<uint32_t>(frame.imported_output->offset));
+      if (YuvConverter::can_encode(yuv_format, layout)) {
+        frame.output_layout = layout;
+      } else {
+        frame.imported_output.reset();
+      }
+    } else if (frame.imported_output) {
+      output_row_length = output_rowspan / 4;
+      output_offset = static_cast<unsigned>(frame.imported_output->offset / 4);
+    }
+  }
+  if (encode_yuv) {
+    create_yuv_descriptor_sets(frame, *converter);
+    if (!frame.yuv_encode_buffer) {
+      frame.yuv_encode_buffer = shared.resource_pool.acquire_buffer(
+          frame.output_width * frame.output_height * 4,
+          vk::BufferUsageFlagBits::eStorageBuffer,
+          vk::MemoryPropertyFlagBits::eDeviceLocal);
+    }
+  }
+
+  UniformsView uniforms{
+      .data =
+          {
+              .iResolution_w = static_cast<float>(output_image.width),
+              .iResolution_h = static_cast<float>(output_image.height),
+              .iTime = static_cast<float>(project_time),
+              .iSampleRate = 0,
+              .iFrameRate = static_cast<float>(framerate),
+              .iWet = static_cast<float>(parms[0]),
+              .num_inputs =
+                  std::min({static_cast<int>(max_num_inputs), num_inputs}),
+              .output_row_length = output_row_length,
+              .output_offset = output_offset,
+          },
+  };
+
+  {
+    vk::CommandBufferBeginInfo begin_info{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
+    };
+    cmd.begin(begin_info);
+  }
+
+  {
+    // Frames still in flight may be writing the image this one samples as
+    // ogler_previous_frame, or reading from resources this one overwrites
+    vk::MemoryBarrier barrier{
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite |
+                         vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask =
+            vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite |
+            vk::AccessFlagBits::eTransferRead |
+            vk::AccessFlagBits::eTransferWrite,
+    };
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader |
+                            vk::PipelineStageFlagBits::eTransfer,
+                        vk::PipelineStageFlagBits::eComputeShader |
+                            vk::PipelineStageFlagBits::eTransfer,
+                        {}, {barrier}, {}, {});
+  }
+
+  if (render_state->uses_gmem) {
+    frame.gmem =
+        shared.get_gmem(queue_index, render_state->gmem_first_block,
+                        render_state->gmem_end_block);
+    record_gmem_upload(frame);
+  }
 
   std::array<std::pair<float, float>, max_num_inputs> input_resolution;
   std::array<vk::DescriptorImageInfo, max_num_inputs> input_image_info;
+  // Inputs this frame uploads can only be shared with other instances once
+  // the upload has been submitted
+  std::vector<std::shared_ptr<CachedInput>> uploaded;
+  // Frames are requested in their native format, so that REAPER doesn't have
+  // to convert YUV sources on the CPU. Formats that can't be converted on the
+  // GPU are requested again as RGBA.
+  bool convert_yuv = shared.get_yuv_converter() != nullptr;
+  auto input_format = convert_yuv ? FrameFormat::Default : FrameFormat::RGBA;
+  auto is_supported_input = [&](int format) {
+    return format == (int)FrameFormat::RGBA ||
+           (convert_yuv && (format == (int)FrameFormat::YV12 ||
+                            format == (int)FrameFormat::YUY2));
+  };
   for (size_t i = 0; i < max_num_inputs; ++i) {
-    auto input_frame = vproc->renderInputVideoFrame(i, (int)FrameFormat::RGBA);
+    // Inputs the shader never reads aren't even rendered
+    bool used = (render_state->used_inputs >> i) & 1;
+    auto input_frame =
+        used ? vproc->renderInputVideoFrame(i, (int)input_format) : nullptr;
+    if (input_frame && !is_supported_input(input_frame->get_fmt())) {
+      input_frame = vproc->renderInputVideoFrame(i, (int)FrameFormat::RGBA);
+    }
     if (!input_frame) {
       input_resolution[i] = {1.f, 1.f};
       input_image_info[i] = {
@@ -795,235 +2299,158 @@ IVideoFrame *Ogler::video_process_frame(std::span<const double> parms,
     } else {
       auto input_w = input_frame->get_w();
       auto input_h = input_frame->get_h();
-      auto input_rowspan = input_frame->get_rowspan();
-      auto input_bits = get_frame_bits(input_frame);
-
-      if (i >= input_images.size()) {
-        input_images.push_back(create_input_image(input_w, input_h));
-      }
-
-      auto &input_image = input_images[i];
-
-      if (input_image.image.width != input_w ||
-          input_image.image.height != input_h) {
-        input_image = create_input_image(input_w, input_h);
+      auto hash = hash_frame(input_frame);
+      // Outputs of other instances may still be on the GPU
+      auto input_image = shared.frame_handoff.find(input_frame, hash);
+      if (!input_image) {
+        // The same frame may be bound to more than one input
+        auto it =
+            std::find_if(uploaded.begin(), uploaded.end(), [&](auto &e) {
+              return e->hash == hash && e->image.width == input_w &&
+                     e->image.height == input_h;
+            });
+        input_image = it != uploaded.end()
+                          ? *it
+                          : shared.input_cache.find(hash, input_w, input_h);
+        // Uploads on other queues may not have run yet
+        if (input_image && input_image->queue_index != queue_index &&
+            !shared.scheduler.is_complete(input_image->queue_index,
+                                          input_image->upload_serial)) {
+          input_image = nullptr;
+        }
+        if (!input_image) {
+          input_image = shared.input_cache.reclaim(input_w, input_h);
+          if (!input_image) {
+            input_image = create_cached_input(input_w, input_h);
+          }
+          input_image->hash = hash;
+          upload_input(frame, i, *input_image, input_frame);
+          uploaded.push_back(input_image);
+        }
       }
 
       input_resolution[i] = {static_cast<float>(input_w),
                              static_cast<float>(input_h)};
       input_image_info[i] = {
           .sampler = *sampler,
-          .imageView = *input_image.view,
-          .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+          .imageView = *input_image->view,
+          .imageLayout = input_image->layout(),
       };
-
-      copy_image(input_bits, input_image.transfer_buffer.map, input_w, input_h,
-                 input_rowspan, input_w * 4);
-
-      {
-        transition_image_layout_upload(command_buffer, input_image.image,
-                                       vk::ImageLayout::eUndefined,
-                                       vk::ImageLayout::eTransferDstOptimal);
-
-        vk::BufferImageCopy region{
-            .bufferOffset = 0,
-            .bufferRowLength = 0,
-            .bufferImageHeight = 0,
-            .imageSubresource =
-                {
-                    .aspectMask = vk::ImageAspectFlagBits::eColor,
-                    .layerCount = 1,
-                },
-            .imageExtent =
-                {
-                    .width = static_cast<uint32_t>(input_w),
-                    .height = static_cast<uint32_t>(input_h),
-                    .depth = 1,
-                },
-        };
-        command_buffer.copyBufferToImage(
-            *input_image.transfer_buffer.buffer, *input_image.image.image,
-            vk::ImageLayout::eTransferDstOptimal, {region});
-
-        transition_image_layout_upload(command_buffer, input_image.image,
-                                       vk::ImageLayout::eTransferDstOptimal,
-                                       vk::ImageLayout::eShaderReadOnlyOptimal);
-      }
+      frame.input_images.push_back(std::move(input_image));
     }
   }
 
-  {
-    vk::DescriptorImageInfo output_image_info{
-        .sampler = *sampler,
-        .imageView = *output_image_view,
-        .imageLayout = vk::ImageLayout::eGeneral,
-    };
-    vk::DescriptorBufferInfo gmem_buffer_info{
-        .buffer = *shared.gmem_buffer.buffer,
-        .offset = 0,
-        .range = gmem_size * sizeof(float),
-    };
-    vk::DescriptorBufferInfo input_resolution_info{
-        .buffer = *input_resolution_buffer.buffer,
-        .offset = 0,
-        .range = sizeof(input_resolution),
-    };
-    vk::DescriptorImageInfo previous_frame_info{
-        .sampler = *sampler,
-        .imageView = *previous_image_view,
-        .imageLayout = vk::ImageLayout::eGeneral,
-    };
-
-    std ::vector<vk::WriteDescriptorSet> write_descriptor_sets = {
-        // Input texture
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 1,
-            .descriptorCount = max_num_inputs,
-            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-            .pImageInfo = input_image_info.data(),
-        },
-        // Output texture
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 2,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eStorageImage,
-            .pImageInfo = &output_image_info,
-        },
-        // gmem
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 3,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eStorageBuffer,
-            .pBufferInfo = &gmem_buffer_info,
-        },
-        // iChannelResolution[]
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 4,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eUniformBuffer,
-            .pBufferInfo = &input_resolution_info,
-        },
-        // ogler_previous_frame
-        {
-            .dstSet = *compute->descriptor_set,
-            .dstBinding = 5,
-            .descriptorCount = 1,
-            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-            .pImageInfo = &previous_frame_info,
-        },
-    };
-
-    std::copy(input_resolution.begin(), input_resolution.end(),
-              input_resolution_buffer.map.begin());
-
-    vk::DescriptorBufferInfo uniforms_info{
-        .range = sizeof(float) * data.parameters.size(),
-    };
-    if (params_buffer && !data.parameters.empty()) {
-      uniforms_info.buffer = *params_buffer->buffer;
-      // keeping in mind parms[0] is iWet
-      for (size_t i = 0; i < parms.size() - 1; ++i) {
-        params_buffer->map[i] = parms[i + 1];
-      }
-      write_descriptor_sets.push_back({
-          .dstSet = *compute->descriptor_set,
-          .dstBinding = 0,
-          .descriptorCount = 1,
-          .descriptorType = vk::DescriptorType::eUniformBuffer,
-          .pBufferInfo = &uniforms_info,
-      });
-    }
-
-    shared.vulkan.device.updateDescriptorSets(write_descriptor_sets, {});
+  // keeping in mind parms[0] is iWet. The host may still be reporting the
+  // parameters of the previous shader for a few frames after a swap.
+  std::vector<float> params;
+  for (size_t i = 0; i < render_state->parameters.size(); ++i) {
+    params.push_back(i + 1 < parms.size()
+                         ? static_cast<float>(parms[i + 1])
+                         : render_state->parameters[i].default_value);
   }
-
-  command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute,
-                              *compute->pipeline);
-  command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
-                                    *compute->pipeline_layout, 0,
-                                    {*compute->descriptor_set}, {});
-  command_buffer.pushConstants<float>(*compute->pipeline_layout,
-                                      vk::ShaderStageFlagBits::eCompute, 0,
-                                      uniforms.values);
-  command_buffer.dispatch(output_image.width, output_image.height, 1);
+  stage_uniforms(frame, input_resolution, params);
+  write_descriptor_set(compute.descriptor_sets[frame_slot], *render_state,
+                       frame, output, previous, input_image_info);
+
+  cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *compute.shared->pipeline);
+  cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                         *compute.shared->pipeline_layout, 0,
+                         {*compute.descriptor_sets[frame_slot]}, {});
+  cmd.pushConstants<float>(*compute.shared->pipeline_layout,
+                           vk::ShaderStageFlagBits::eCompute, 0,
+                           uniforms.values);
   {
-    vk::ImageMemoryBarrier img_mem_barrier{
-        .srcAccessMask = vk::AccessFlagBits::eMemoryWrite,
-        .dstAccessMask = vk::AccessFlagBits::eTransferRead,
-        .oldLayout = vk::ImageLayout::eGeneral,
-        .newLayout = vk::ImageLayout::eGeneral,
+    auto group_w = compute.shared->pipeline_spec_data.workgroup_size_x;
+    auto group_h = compute.shared->pipeline_spec_data.workgroup_size_y;
+    cmd.dispatch((output_image.width + group_w - 1) / group_w,
+                 (output_image.height + group_h - 1) / group_h, 1);
+  }
+  if (encode_yuv) {
+    vk::BufferMemoryBarrier buf_mem_barrier{
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = *output_image.image,
-        .subresourceRange =
-            {
-                .aspectMask = vk::ImageAspectFlagBits::eColor,
-                .levelCount = 1,
-                .layerCount = 1,
-            },
+        .buffer = *frame.yuv_encode_buffer->buffer,
+        .size = VK_WHOLE_SIZE,
     };
-    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eBottomOfPipe,
-                                   vk::PipelineStageFlagBits::eTransfer, {}, {},
-                                   {}, {img_mem_barrier});
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eComputeShader, {}, {},
+                        {buf_mem_barrier}, {});
+    converter->record_encode(
+        cmd, frame.yuv_encode_descriptor_sets[0], yuv_format,
+        *frame.yuv_encode_buffer->buffer,
+        frame.imported_output ? *frame.imported_output->buffer
+                              : *frame.output_buffer->buffer,
+        frame.output_layout);
   }
-  {
-    vk::BufferImageCopy region{
-        .imageSubresource =
-            {
-                .aspectMask = vk::ImageAspectFlagBits::eColor,
-                .layerCount = 1,
-            },
-        .imageExtent =
-            {
-                .width = static_cast<uint32_t>(output_image.width),
-                .height = static_cast<uint32_t>(output_image.height),
-                .depth = 1,
-            },
-    };
-    command_buffer.copyImageToBuffer(*output_image.image,
-                                     vk::ImageLayout::eGeneral,
-                                     *output_transfer_buffer.buffer, {region});
+  if (shared.frame_handoff.take_consumed(this)) {
+    handoff_idle_frames = 0;
+  } else {
+    ++handoff_idle_frames;
+  }
+  frame.publish_handoff = !encode_yuv &&
+                          (handoff_idle_frames < handoff_idle_limit ||
+                           frame_index % handoff_probe_interval == 0);
+  if (frame.publish_handoff) {
+    record_handoff(frame, output_row_length, output_offset);
   }
   {
     vk::BufferMemoryBarrier buf_mem_barrier{
-        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
         .dstAccessMask = vk::AccessFlagBits::eHostRead,
         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .buffer = *output_transfer_buffer.buffer,
+        .buffer = frame.imported_output ? *frame.imported_output->buffer
+                                        : *frame.output_buffer->buffer,
         .size = VK_WHOLE_SIZE,
     };
-    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
-                                   vk::PipelineStageFlagBits::eHost, {}, {},
-                                   {buf_mem_barrier}, {});
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eHost, {}, {},
+                        {buf_mem_barrier}, {});
   }
-  command_buffer.end();
-
-  vk::SubmitInfo SubmitInfo{
-      .commandBufferCount = 1,
-      .pCommandBuffers = &*command_buffer,
-  };
-  queue.submit({SubmitInfo}, *fence);
-  auto res = shared.vulkan.device.waitForFences({*fence},      // List of fences
-                                                true,          // Wait All
-                                                uint64_t(-1)); // Timeout
-  assert(res == vk::Result::eSuccess);
-
-  {
-    auto output_bits = get_frame_bits(output_frame);
-    copy_image(output_transfer_buffer.map, output_bits, output_w, output_h,
-               output_w * 4, output_rowspan);
+  cmd.end();
+
+  frame.submit_serial =
+      shared.scheduler.submit_batched(queue_index, *cmd, *frame.fence);
+  frame.submitted = true;
+  publish_gmem_uploads(frame);
+  for (auto &input : uploaded) {
+    input->queue_index = queue_index;
+    input->upload_serial = frame.submit_serial;
+    shared.input_cache.insert(std::move(input));
+  }
+  ++frame_index;
+
+  // Hand back the oldest frame in flight. With a single frame in flight this
+  // is the one that was just submitted. While the ring is filling up, e.g.
+  // after a recompile, the first frame is handed back again and kept in the
+  // ring, rather than dropping frames until the ring is full.
+  auto oldest = frame_index;
+  while (!frames[oldest % frames.size()].submitted) {
+    ++oldest;
+  }
+  auto &ready = frames[oldest % frames.size()];
+  bool filling = oldest != frame_index;
+
+  shared.scheduler.wait(queue_index, ready.submit_serial, *ready.fence);
+
+  output_frame = ready.output_target
+                     ? ready.output_target
+                     : vproc->newVideoFrame(ready.output_width,
+                                            ready.output_height,
+                                            (int)ready.output_format);
+  if (!ready.imported_output) {
+    copy_output(ready, output_frame);
+  }
+  if (filling) {
+    return output_frame;
+  }
+  if (ready.publish_handoff) {
+    shared.frame_handoff.publish(this, output_frame, ready.handoff_image);
   }
 
-  shared.vulkan.device.resetFences({*fence});
-  command_buffer.reset();
-
-  std::swap(output_image, previous_image);
-  std::swap(output_image_view, previous_image_view);
+  retire_frame(ready);
 
   return output_frame;
 }
@@ -1096,7 +2523,7 @@ class OglerEditorInterface final : public EditorInterface {
 public:
   OglerEditorInterface(Ogler &plugin) : plugin(plugin) {}
 
-  void recompile_shaders() final { plugin.host.request_restart(); }
+  void recompile_shaders() final { plugin.recompile_shaders(); }
 
   void set_shader_source(const std::string &source) final {
     plugin.data.video_shader = source;
@@ -1126,11 +2553,28 @@ public:
     plugin.host.state_mark_dirty();
   }
 
+  int get_frames_in_flight() final { return plugin.data.frames_in_flight; }
+
+  void set_frames_in_flight(int frames) final {
+    frames = std::clamp(frames, 1, Ogler::max_frames_in_flight);
+    plugin.data.frames_in_flight = frames;
+    plugin.requested_frames_in_flight = frames;
+    plugin.host.state_mark_dirty();
+  }
+
   void set_parameter(size_t index, float value) final {
     std::unique_lock<std::mutex> lock(plugin.video_mutex);
     plugin.data.parameters[index].value = value;
     plugin.host.params_rescan(CLAP_PARAM_RESCAN_VALUES);
   }
+
+  std::string get_memory_usage() final {
+    auto stats = plugin.shared.vulkan.allocator.stats();
+    return "GPU memory: " + std::to_string(stats.used_bytes >> 20) + " of " +
+           std::to_string(stats.reserved_bytes >> 20) + " MiB used by " +
+           std::to_string(stats.num_allocations) + " allocations in " +
+           std::to_string(stats.num_blocks) + " blocks";
+  }
 };
 
 bool Ogler::gui_set_parent(const clap_window_t &window) {
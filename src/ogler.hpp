@@ -30,8 +30,14 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+#include <atomic>
+#include <future>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <sciter-js/sciter-om-def.h>
 
@@ -50,6 +56,12 @@
 #include "clap/host.hpp"
 
 #include "compile_shader.hpp"
+#include "ogler_cache.hpp"
+#include "ogler_compile.hpp"
+#include "ogler_pool.hpp"
+#include "ogler_scheduler.hpp"
+#include "ogler_staging.hpp"
+#include "ogler_yuv.hpp"
 #include "vulkan_context.hpp"
 
 #include "sciter_window.hpp"
@@ -64,7 +76,7 @@ namespace ogler {
 enum class FrameFormat : int {
   Default = 0,
   YV12 = 'YV12',
-  YUV2 = 'YUV2',
+  YUY2 = 'YUY2',
   RGBA = 'RGBA',
 };
 
@@ -86,6 +98,7 @@ struct PatchData {
   static constexpr int default_editor_w = 1024;
   static constexpr int default_editor_h = 768;
   static constexpr int default_editor_zoom = 1;
+  static constexpr int default_frames_in_flight = 1;
 
   std::string video_shader{
       R"(void mainImage(out vec4 fragColor, in vec2 fragCoord) {
@@ -101,20 +114,197 @@ struct PatchData {
   int editor_w = default_editor_w;
   int editor_h = default_editor_h;
   int editor_zoom = default_editor_zoom;
+  // How many frames the GPU may work on at once, see Ogler::frames
+  int frames_in_flight = default_frames_in_flight;
 
   std::vector<Parameter> parameters;
 
+  // Result of the last successful compilation, so that loading a project
+  // doesn't need to run the compiler again. Only valid if compiled_shader_key
+  // matches the key of the current sources.
+  std::optional<ShaderData> compiled_shader;
+  std::string compiled_shader_key;
+
   void deserialize(std::istream &);
   void serialize(std::ostream &);
 };
 
+// An input frame uploaded to the GPU, identified by its contents
+struct CachedInput {
+  Image image;
+  vk::raii::ImageView view;
+  uint64_t hash;
+  // Set for linear images in host-visible memory, which are written in place
+  // and always in the General layout
+  std::span<char> map;
+  vk::DeviceSize row_pitch = 0;
+  // Submission that uploaded the contents
+  uint32_t queue_index = 0;
+  uint64_t upload_serial = 0;
+
+  vk::ImageLayout layout() const {
+    return map.empty() ? vk::ImageLayout::eShaderReadOnlyOptimal
+                       : vk::ImageLayout::eGeneral;
+  }
+
+  size_t size_bytes() const { return size_t(image.width) * image.height * 4; }
+};
+
+// Input frames shared by all instances, so that the same frame is uploaded
+// once no matter how many instances read it. Entries are handed out as
+// shared_ptrs: the ones still referenced by a frame in flight are never
+// evicted or reused.
+//
+// Entries are keyed by contents rather than by the item REAPER reports for
+// an input: an item renders a different frame at every position, and
+// different items can show the same picture.
+class InputCache {
+  using EntryList = std::list<std::shared_ptr<CachedInput>>;
+
+  std::mutex mutex;
+  // Most recently used first
+  EntryList entries;
+  std::unordered_multimap<uint64_t, EntryList::iterator> by_hash;
+  size_t total_bytes = 0;
+  size_t capacity;
+
+  EntryList::iterator erase(EntryList::iterator it);
+
+public:
+  InputCache(size_t capacity);
+
+  std::shared_ptr<CachedInput> find(uint64_t hash, int w, int h);
+  // Once the cache is full, takes the least recently used entry of the given
+  // size out of it, so that its image can be reused for new contents
+  std::shared_ptr<CachedInput> reclaim(int w, int h);
+  // Evicts unreferenced entries until the cache is back under its capacity
+  void insert(std::shared_ptr<CachedInput> entry);
+};
+
+// Output frames that are still on the GPU, by the address of their pixels.
+// An instance that gets another instance's output as its input binds the
+// image instead of uploading the frame again. Frames are checked against a
+// hash of their contents, since REAPER reuses their memory.
+class FrameHandoff {
+  struct Entry {
+    const void *producer;
+    uint64_t hash;
+    int width;
+    int height;
+    // Owned by the producer's frame, which may already have reused it
+    std::weak_ptr<CachedInput> image;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<const char *, Entry> entries;
+  // Producers whose outputs were found since they last asked
+  std::unordered_set<const void *> consumed;
+
+public:
+  // The image must hold the contents of frame, uploaded by a submission
+  // that is done
+  void publish(const void *producer, IVideoFrame *frame,
+               std::shared_ptr<CachedInput> image);
+  // Returns null unless frame was published and hasn't changed since. hash
+  // is the frame's hash_frame.
+  std::shared_ptr<CachedInput> find(IVideoFrame *frame, uint64_t hash);
+  // Called before the image is overwritten
+  void forget(const CachedInput *image);
+  // Whether any of the producer's outputs were found since the last call
+  bool take_consumed(const void *producer);
+};
+
+struct SharedPipeline;
+
+// Compiled pipelines, shared by the instances running the same shader. Only
+// the pipelines some instance is still using are kept.
+class PipelineRegistry {
+public:
+  struct Key {
+    // canonical_spirv_hash of the code
+    uint64_t spirv_hash;
+    unsigned workgroup_size_x;
+    unsigned workgroup_size_y;
+    bool store_output_image;
+
+    auto operator<=>(const Key &) const = default;
+  };
+
+private:
+  friend struct OglerTestAccess;
+
+  std::mutex mutex;
+  std::map<Key, std::weak_ptr<SharedPipeline>> entries;
+
+public:
+  std::shared_ptr<SharedPipeline> find(const Key &key);
+  // If another instance registered the same pipeline in the meantime, that
+  // one is returned instead, so that both end up sharing it
+  std::shared_ptr<SharedPipeline>
+  insert(const Key &key, std::shared_ptr<SharedPipeline> pipeline);
+};
+
+// What the copy of an EEL RAM block in SharedGmem holds
+struct GmemBlock {
+  // Hash of the contents last uploaded, by the submission with that serial.
+  // Empty if they never were.
+  std::optional<uint64_t> hash;
+  uint64_t serial = 0;
+  // Uploads that were recorded but not submitted yet. Until they are, the
+  // contents the next frame sees aren't known.
+  uint32_t pending = 0;
+};
+
+// EEL RAM as the shaders see it. Only covers the blocks from first_block to
+// end_block, which shaders reach through the descriptor offset.
+struct SharedGmem {
+  Buffer<float> buffer;
+  size_t first_block;
+  size_t end_block;
+
+  std::mutex hashes_mutex;
+  std::vector<GmemBlock> blocks;
+};
+
 struct SharedVulkan {
   VulkanContext vulkan;
 
-  Buffer<float> gmem_transfer_buffer;
-  Buffer<float> gmem_buffer;
+  WorkgroupSizeTable workgroup_sizes;
+
+  // Shared by all pipelines, persisted across sessions
+  std::filesystem::path pipeline_cache_path;
+  vk::raii::PipelineCache pipeline_cache;
+  PipelineRegistry pipelines;
+
+  SubmitScheduler scheduler;
+
+  // One copy of gmem per queue, since frames on different queues aren't
+  // ordered with each other. Created once a shader on the queue reads gmem,
+  // and replaced by a larger one when a shader needs blocks it doesn't cover.
+  // Frames in flight keep the copy they use alive.
+  std::mutex gmem_mutex;
+  std::vector<std::shared_ptr<SharedGmem>> gmem;
+
+  InputCache input_cache;
+  FrameHandoff frame_handoff;
+  ResourcePool resource_pool;
+  HostImportCache host_imports;
+  StagingRing staging_ring;
+
+  std::once_flag yuv_converter_once;
+  std::unique_ptr<YuvConverter> yuv_converter;
+
+  CompileService compile_service;
 
   SharedVulkan();
+
+  // Built on first use. Null if the conversion shaders can't be built.
+  YuvConverter *get_yuv_converter();
+  // Covers at least the blocks from first_block to end_block
+  std::shared_ptr<SharedGmem> get_gmem(uint32_t queue_index,
+                                       size_t first_block, size_t end_block);
+
+  void save_pipeline_cache();
 };
 
 struct InputImage {
@@ -123,10 +313,85 @@ struct InputImage {
   vk::raii::ImageView view;
 };
 
+struct VideoFrameRelease {
+  void operator()(IVideoFrame *frame) { frame->Release(); }
+};
+
+// An input frame whose memory the GPU copies from directly. The frame is
+// kept alive until the copy is done.
+struct ImportedInput {
+  std::unique_ptr<IVideoFrame, VideoFrameRelease> frame;
+  std::shared_ptr<HostBuffer> buffer;
+};
+
+// Everything a single frame needs while it's in flight on the GPU. Frames are
+// recorded into a ring of these, so the CPU side of a frame can overlap with
+// the GPU work of the previous ones.
+struct FrameResources {
+  vk::raii::CommandBuffer command_buffer;
+  vk::raii::Fence fence;
+
+  // Ranges of the staging ring this frame's uploads use, released when it's
+  // retired
+  std::vector<uint64_t> staging_ranges;
+  // Staging for the uploads that didn't fit in the ring
+  std::vector<PooledBufferPtr> staging_overflow;
+  // Frames that stay alive for long, like the one used for tuning, would hold
+  // back every range allocated after theirs
+  bool use_staging_ring = true;
+  // Inputs uploaded straight from REAPER's memory instead
+  std::vector<ImportedInput> imported_inputs;
+  // For converting YUV inputs by input index, and the YUV output. Created on
+  // first use.
+  std::optional<vk::raii::DescriptorPool> yuv_descriptor_pool;
+  std::vector<vk::raii::DescriptorSet> yuv_descriptor_sets;
+  std::vector<vk::raii::DescriptorSet> yuv_encode_descriptor_sets;
+  // Keeps the cached inputs used by this frame alive until it's retired
+  std::vector<std::shared_ptr<CachedInput>> input_images;
+  // Uniforms, read by the shader straight from staging
+  StagingRange input_resolutions{};
+  std::optional<StagingRange> params;
+
+  // The shader writes its output here, packed like the REAPER frame it's
+  // read back into
+  PooledBufferPtr output_buffer;
+  // Used instead of output_buffer when the frame REAPER gave us is imported,
+  // and the shader writes into it directly
+  std::shared_ptr<HostBuffer> imported_output;
+  IVideoFrame *output_target = nullptr;
+  // For YUV formats, the shader writes BGRA pixels to yuv_encode_buffer,
+  // which are then converted into output_layout
+  FrameFormat output_format = FrameFormat::RGBA;
+  YuvLayout output_layout{};
+  PooledBufferPtr yuv_encode_buffer;
+  // Copy of the output, for instances that get it as their input. Only
+  // recorded for RGBA output while downstream instances use it.
+  std::shared_ptr<CachedInput> handoff_image;
+  bool publish_handoff = false;
+  // Copy of gmem the shader reads, if it reads it at all
+  std::shared_ptr<SharedGmem> gmem;
+  // EEL RAM blocks this frame uploads, with their hashes. Published once the
+  // frame is submitted.
+  std::vector<std::pair<size_t, uint64_t>> gmem_uploads;
+  int output_width;
+  int output_height;
+
+  bool submitted = false;
+  uint64_t submit_serial = 0;
+};
+
+// Outcome of a background compilation, handed over to the main thread
+struct CompileResult {
+  std::variant<ShaderData, std::string> data;
+  std::string sources_key;
+};
+
 class Editor;
 
 class Ogler final {
   friend class OglerEditorInterface;
+  // Drives the video processor directly, for tests running without REAPER
+  friend struct OglerTestAccess;
   const clap::host &host;
   std::unique_ptr<IReaper> reaper;
 
@@ -135,32 +400,51 @@ class Ogler final {
   constexpr static int fallback_output_width = 1024;
   constexpr static int fallback_output_height = 1024;
 
-  std::optional<int> shader_output_width;
-  std::optional<int> shader_output_height;
+  constexpr static int default_workgroup_size_x = 8;
+  constexpr static int default_workgroup_size_y = 8;
+
+  constexpr static int max_frames_in_flight = 4;
 
   static SharedVulkan &get_shared_vulkan();
 
   SharedVulkan &shared;
   vk::raii::Sampler sampler;
+  // Command pools can't be used from more than one thread at once, so each
+  // instance has its own
+  vk::raii::CommandPool command_pool;
   vk::raii::CommandBuffer command_buffer;
-  vk::raii::Queue queue;
+  uint32_t queue_index;
   vk::raii::Fence fence;
 
-  Buffer<char> output_transfer_buffer;
-  Image output_image;
-  vk::raii::ImageView output_image_view;
-  Image previous_image;
-  vk::raii::ImageView previous_image_view;
+  // Frame N renders into output_images[N % size] and samples the previous
+  // frame from the image before it, so there's one more than frames in flight
+  // (unless the shader doesn't read the previous frame)
+  std::vector<PooledImagePtr> output_images;
+  std::vector<FrameResources> frames;
+  uint64_t frame_index = 0;
+  // Depth of the frame ring, from PatchData::frames_in_flight. The video
+  // thread rebuilds the ring when it changes.
+  std::atomic<int> requested_frames_in_flight{
+      PatchData::default_frames_in_flight};
+  // Frames since an output of this instance was last used by another
+  // instance, see FrameHandoff
+  uint64_t handoff_idle_frames = 0;
 
   InputImage empty_input;
-  std::vector<InputImage> input_images;
-
-  std::optional<Buffer<float>> params_buffer;
-
-  Buffer<std::pair<float, float>> input_resolution_buffer;
 
   struct Compute;
-  std::unique_ptr<Compute> compute;
+  struct RenderState;
+  // Only used by the video thread. Replaced by pending_state at the start of
+  // a frame, so a frame always uses a single pipeline from start to finish.
+  std::shared_ptr<RenderState> render_state;
+  std::atomic<std::shared_ptr<RenderState>> pending_state;
+
+  // Shaders are compiled in the background. Only the most recently started
+  // compilation gets to publish its result.
+  std::mutex compile_mutex;
+  uint64_t compile_generation = 0;
+  std::vector<std::future<void>> compile_tasks;
+  std::optional<CompileResult> compile_result;
 
   IVideoFrame *output_frame{};
 
@@ -175,41 +459,98 @@ class Ogler final {
   double ***gmem{};
 
   std::optional<std::string> compiler_error;
+  bool params_rescan_pending = false;
 
   InputImage create_input_image(int w, int h);
-
-  template <typename Func> void one_shot_execute(Func f) {
+  std::shared_ptr<CachedInput> create_cached_input(int w, int h);
+  PooledImagePtr create_output_image(int w, int h);
+  FrameResources create_frame_resources(int output_w, int output_h,
+                                        vk::raii::CommandPool &command_pool);
+
+  void create_output_images(int w, int h);
+  // Records clearing the images and leaving them in the General layout
+  void prepare_output_images(vk::raii::CommandBuffer &cmd,
+                             std::span<PooledImagePtr> images);
+  void create_frames(size_t num_frames);
+  // Records the upload of an input frame, straight from its memory if it can
+  // be imported, otherwise through staging
+  void upload_input(FrameResources &frame, size_t index, CachedInput &input,
+                    IVideoFrame *source);
+  // Space for an upload recorded into frame, valid until it's retired
+  StagingRange stage(FrameResources &frame, size_t size);
+  void stage_uniforms(FrameResources &frame,
+                      std::span<const std::pair<float, float>> resolutions,
+                      std::span<const float> params);
+  void retire_frame(FrameResources &frame);
+  // Copies the output into frame.handoff_image, the output buffer is read
+  // from offset with rows row_length pixels apart
+  void record_handoff(FrameResources &frame, uint32_t row_length,
+                      uint32_t offset);
+  void drain_frames();
+
+  template <typename Func>
+  void one_shot_execute(vk::raii::CommandBuffer &cmd, vk::raii::Fence &fence,
+                        Func f) {
     {
       vk::CommandBufferBeginInfo begin_info{
           .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit,
       };
-      command_buffer.begin(begin_info);
+      cmd.begin(begin_info);
     }
     f();
-    command_buffer.end();
+    cmd.end();
 
     vk::SubmitInfo SubmitInfo{
         .commandBufferCount = 1,
-        .pCommandBuffers = &*command_buffer,
+        .pCommandBuffers = &*cmd,
     };
-    queue.submit({SubmitInfo}, *fence);
-    auto res = shared.vulkan.device.waitForFences({*fence}, // List of fences
-                                                  true,     // Wait All
-                                                  uint64_t(-1)); // Timeout
-    assert(res == vk::Result::eSuccess);
+    auto serial =
+        shared.scheduler.submit(queue_index, {&SubmitInfo, 1}, *fence);
+    shared.scheduler.wait(queue_index, serial, *fence);
     shared.vulkan.device.resetFences({*fence});
-    command_buffer.reset();
+    cmd.reset();
+  }
+
+  template <typename Func> void one_shot_execute(Func f) {
+    one_shot_execute(command_buffer, fence, f);
   }
 
   IVideoFrame *video_process_frame(std::span<const double> parms,
                                    double project_time, double framerate,
                                    FrameFormat force_format) noexcept;
   void update_frame_buffers() noexcept;
+  void record_gmem_upload(FrameResources &frame);
+  void publish_gmem_uploads(FrameResources &frame);
+  void write_descriptor_set(
+      vk::raii::DescriptorSet &descriptor_set, const RenderState &state,
+      FrameResources &frame, PooledImage &output, PooledImage &previous,
+      std::span<const vk::DescriptorImageInfo> input_image_info);
+
+  // Descriptor sets are the instance's own, the pipeline is shared with any
+  // other instance running the same code
+  std::unique_ptr<Compute>
+  create_compute(const std::vector<unsigned> &spirv_code, uint64_t spirv_hash,
+                 unsigned workgroup_size_x, unsigned workgroup_size_y,
+                 uint32_t num_sets, bool store_output_image);
+  std::unique_ptr<Compute>
+  create_tuned_compute(const std::vector<unsigned> &spirv_code,
+                       const RenderState &state);
+
+  std::variant<std::shared_ptr<RenderState>, std::string>
+  create_render_state(const ShaderData &shader_data);
+  // Builds the render state for a compiled shader and hands both over,
+  // unless a newer compilation was started. Returns false in that case.
+  bool publish_compile_result(uint64_t generation, CompileResult result);
+  void run_compile(uint64_t generation,
+                   std::vector<std::pair<std::string, std::string>> sources,
+                   std::string sources_key,
+                   std::optional<ShaderData> compiled_shader);
+  void apply_render_state(std::shared_ptr<RenderState> state);
 
   void handle_events(const clap_input_events_t &events);
 
-  int get_output_width();
-  int get_output_height();
+  int get_output_width(const RenderState *state);
+  int get_output_height(const RenderState *state);
 
 public:
   static constexpr const char *id = "dev.bertolaccini.ogler";
@@ -229,7 +570,9 @@ public:
   Ogler(const clap::host &host);
   ~Ogler();
 
-  std::optional<std::string> recompile_shaders();
+  // Compiles the shader in the background. The result is picked up by the
+  // video thread at the next frame, and by the main thread in on_main_thread.
+  void recompile_shaders();
 
   bool init();
   bool activate(double sample_rate, uint32_t min_frames_count,
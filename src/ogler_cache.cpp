@@ -0,0 +1,189 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_cache.hpp"
+
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <nlohmann/json.hpp>
+
+namespace ogler {
+
+std::filesystem::path get_cache_directory() {
+  std::filesystem::path dir;
+  if (auto local_app_data = std::getenv("LOCALAPPDATA")) {
+    dir = std::filesystem::path(local_app_data) / "ogler";
+  } else {
+    dir = std::filesystem::temp_directory_path() / "ogler";
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  return dir;
+}
+
+uint64_t hash_bytes(std::span<const std::byte> data, uint64_t seed) {
+  // FNV-1a
+  uint64_t hash = seed;
+  for (auto b : data) {
+    hash ^= static_cast<uint64_t>(b);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint64_t hash_words(std::span<const uint64_t> data) {
+  // Same round function as XXH64, over four independent lanes
+  constexpr uint64_t prime1 = 0x9e3779b185ebca87ull;
+  constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+  auto round = [](uint64_t acc, uint64_t word) {
+    return std::rotl(acc + word * prime2, 31) * prime1;
+  };
+
+  std::array<uint64_t, 4> lanes{prime1 + prime2, prime2, 0, 0 - prime1};
+  size_t i = 0;
+  for (; i + lanes.size() <= data.size(); i += lanes.size()) {
+    for (size_t k = 0; k < lanes.size(); ++k) {
+      lanes[k] = round(lanes[k], data[i + k]);
+    }
+  }
+
+  uint64_t hash = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) +
+                  std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18);
+  for (; i < data.size(); ++i) {
+    hash = round(hash, data[i]);
+  }
+  hash ^= data.size();
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+std::string to_hex(uint64_t value) {
+  std::stringstream ss;
+  ss << std::hex << std::setw(16) << std::setfill('0') << value;
+  return ss.str();
+}
+
+std::vector<uint8_t> read_binary_file(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return {};
+  }
+
+  std::vector<uint8_t> data(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  if (!file.read(reinterpret_cast<char *>(data.data()), data.size())) {
+    return {};
+  }
+  return data;
+}
+
+void write_binary_file(const std::filesystem::path &path,
+                       std::span<const uint8_t> data) {
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      return;
+    }
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!file) {
+      return;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+}
+
+// Returns no entries if the file is missing or corrupt, which only means
+// tuning has to run again
+static std::unordered_map<std::string, std::pair<unsigned, unsigned>>
+read_workgroup_sizes(const std::filesystem::path &path) {
+  std::unordered_map<std::string, std::pair<unsigned, unsigned>> entries;
+  auto data = read_binary_file(path);
+  if (data.empty()) {
+    return entries;
+  }
+
+  try {
+    auto obj = nlohmann::json::parse(data);
+    for (auto &[key, value] : obj.items()) {
+      entries[key] = {value.at(0).get<unsigned>(),
+                      value.at(1).get<unsigned>()};
+    }
+  } catch (const nlohmann::json::exception &) {
+    entries.clear();
+  }
+  return entries;
+}
+
+WorkgroupSizeTable::WorkgroupSizeTable(std::filesystem::path path)
+    : path(std::move(path)), entries(read_workgroup_sizes(this->path)) {}
+
+void WorkgroupSizeTable::save() {
+  // Other REAPER instances may have saved their own results since this one
+  // was loaded: keep them, unless they are for the same key
+  for (auto &[key, value] : read_workgroup_sizes(path)) {
+    entries.try_emplace(key, value);
+  }
+
+  nlohmann::json obj = nlohmann::json::object();
+  for (auto &[key, value] : entries) {
+    obj[key] = {value.first, value.second};
+  }
+
+  auto text = obj.dump();
+  write_binary_file(
+      path, std::span{reinterpret_cast<const uint8_t *>(text.data()),
+                      text.size()});
+}
+
+std::optional<std::pair<unsigned, unsigned>>
+WorkgroupSizeTable::find(const std::string &key) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+void WorkgroupSizeTable::insert(const std::string &key,
+                                std::pair<unsigned, unsigned> size) {
+  std::unique_lock<std::mutex> lock(mutex);
+  entries[key] = size;
+  save();
+}
+} // namespace ogler
@@ -0,0 +1,80 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ogler {
+
+// Per-user directory where ogler keeps data that can be regenerated, but is
+// expensive to do so (e.g. tuning results). Created on first use.
+std::filesystem::path get_cache_directory();
+
+uint64_t hash_bytes(std::span<const std::byte> data,
+                    uint64_t seed = 0xcbf29ce484222325ull);
+
+template <typename T> uint64_t hash_span(std::span<T> data) {
+  return hash_bytes(std::as_bytes(data));
+}
+
+// Word-at-a-time hash for large buffers that need to be compared often, e.g.
+// to detect changes. Much faster than hash_bytes, but not interchangeable
+// with it.
+uint64_t hash_words(std::span<const uint64_t> data);
+
+std::string to_hex(uint64_t value);
+
+// Returns an empty vector if the file can't be read
+std::vector<uint8_t> read_binary_file(const std::filesystem::path &path);
+// Writes to a temporary file first, so that concurrent readers never see a
+// partially written file
+void write_binary_file(const std::filesystem::path &path,
+                       std::span<const uint8_t> data);
+
+class WorkgroupSizeTable {
+  std::filesystem::path path;
+  std::mutex mutex;
+  std::unordered_map<std::string, std::pair<unsigned, unsigned>> entries;
+
+  void save();
+
+public:
+  WorkgroupSizeTable(std::filesystem::path path);
+
+  std::optional<std::pair<unsigned, unsigned>> find(const std::string &key);
+  void insert(const std::string &key, std::pair<unsigned, unsigned> size);
+};
+} // namespace ogler
@@ -0,0 +1,123 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_compile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+namespace ogler {
+
+CompileService::CompileService(size_t max_threads, size_t capacity)
+    : capacity(capacity), max_threads(max_threads) {
+  if (this->max_threads == 0) {
+    this->max_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+CompileService::~CompileService() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  jobs_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void CompileService::run() {
+  // glslang keeps its allocator per thread, so workers don't contend with
+  // each other while compiling
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      jobs_cv.wait(lock, [&]() { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+      --free_workers;
+    }
+
+    CompileOutput output;
+    try {
+      output = compile_shader(job.sources, job.params_binding);
+    } catch (std::exception &e) {
+      output = std::string(e.what());
+    }
+    job.promise.set_value(std::move(output));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    ++free_workers;
+    trim();
+  }
+}
+
+void CompileService::trim() {
+  auto it = results.end();
+  while (results.size() > capacity && it != results.begin()) {
+    --it;
+    if (it->second.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::ready) {
+      index.erase(it->first);
+      it = results.erase(it);
+    }
+  }
+}
+
+std::shared_future<CompileOutput> CompileService::compile(
+    const std::string &key,
+    std::vector<std::pair<std::string, std::string>> sources,
+    int params_binding) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (auto it = index.find(key); it != index.end()) {
+    results.splice(results.begin(), results, it->second);
+    return it->second->second;
+  }
+
+  Job job{
+      .sources = std::move(sources),
+      .params_binding = params_binding,
+  };
+  auto future = job.promise.get_future().share();
+  jobs.push_back(std::move(job));
+  if (jobs.size() > free_workers && workers.size() < max_threads) {
+    workers.emplace_back(&CompileService::run, this);
+    ++free_workers;
+  }
+  results.emplace_front(key, future);
+  index[key] = results.begin();
+  trim();
+  lock.unlock();
+
+  jobs_cv.notify_one();
+  return future;
+}
+} // namespace ogler
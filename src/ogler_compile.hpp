@@ -0,0 +1,92 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include "compile_shader.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace ogler {
+
+using CompileOutput = std::variant<ShaderData, std::string>;
+
+// Runs compile_shader on worker threads, started as jobs come in. Requests for sources
+// that are already being compiled, or were compiled recently, share the same
+// result, so that loading a project with one shader on many tracks compiles
+// it only once.
+class CompileService {
+  struct Job {
+    std::vector<std::pair<std::string, std::string>> sources;
+    int params_binding;
+    std::promise<CompileOutput> promise;
+  };
+
+  using Entry = std::pair<std::string, std::shared_future<CompileOutput>>;
+
+  std::mutex mutex;
+  std::condition_variable jobs_cv;
+  std::deque<Job> jobs;
+  // Compilations in progress and finished, most recently requested first.
+  // Finished ones beyond capacity are dropped.
+  std::list<Entry> results;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  size_t capacity;
+  bool stopping = false;
+  size_t max_threads;
+  std::vector<std::thread> workers;
+  // Workers not busy compiling
+  size_t free_workers = 0;
+
+  void run();
+  void trim();
+
+public:
+  // Zero threads means up to one per core
+  CompileService(size_t max_threads, size_t capacity);
+  ~CompileService();
+
+  CompileService(const CompileService &) = delete;
+  CompileService &operator=(const CompileService &) = delete;
+
+  // key must identify the sources, and what compile_shader makes of them
+  std::shared_future<CompileOutput>
+  compile(const std::string &key,
+          std::vector<std::pair<std::string, std::string>> sources,
+          int params_binding);
+};
+} // namespace ogler
@@ -0,0 +1,182 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_convert.hpp"
+
+#include <cassert>
+#include <cstdint>
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// MSVC allows using any intrinsic regardless of the target architecture,
+// clang and gcc need the functions using them to be marked explicitly
+#if defined(__clang__) || defined(__GNUC__)
+#define OGLER_TARGET(x) __attribute__((target(x)))
+#else
+#define OGLER_TARGET(x)
+#endif
+
+namespace ogler {
+
+namespace {
+struct CpuFeatures {
+  bool avx = false;
+  bool avx512f = false;
+};
+
+void cpuid(int leaf, int subleaf, int regs[4]) {
+#ifdef _MSC_VER
+  __cpuidex(regs, leaf, subleaf);
+#else
+  unsigned a, b, c, d;
+  __cpuid_count(leaf, subleaf, a, b, c, d);
+  regs[0] = a;
+  regs[1] = b;
+  regs[2] = c;
+  regs[3] = d;
+#endif
+}
+
+OGLER_TARGET("xsave") uint64_t xgetbv() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  unsigned lo, hi;
+  __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+}
+
+CpuFeatures detect_cpu_features() {
+  CpuFeatures res;
+  int regs[4];
+  cpuid(0, 0, regs);
+  auto max_leaf = regs[0];
+
+  cpuid(1, 0, regs);
+  bool osxsave = regs[2] & (1 << 27);
+  bool avx = regs[2] & (1 << 28);
+  if (!osxsave || !avx) {
+    return res;
+  }
+
+  // The OS has to save the wider registers on context switches as well
+  auto xcr0 = xgetbv();
+  res.avx = (xcr0 & 0x6) == 0x6;
+  if (res.avx && max_leaf >= 7) {
+    cpuid(7, 0, regs);
+    res.avx512f = (regs[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+  }
+  return res;
+}
+
+// Converts until dst is aligned to `alignment` bytes, returns the number of
+// elements converted
+size_t convert_head(const double *src, float *dst, size_t n, size_t alignment) {
+  size_t i = 0;
+  while (i < n && reinterpret_cast<uintptr_t>(dst + i) % alignment != 0) {
+    dst[i] = static_cast<float>(src[i]);
+    ++i;
+  }
+  return i;
+}
+
+void convert_scalar(const double *src, float *dst, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = static_cast<float>(src[i]);
+  }
+}
+
+void convert_sse2(const double *src, float *dst, size_t n) {
+  size_t i = convert_head(src, dst, n, 16);
+  for (; i + 4 <= n; i += 4) {
+    auto lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+    auto hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+    _mm_stream_ps(dst + i, _mm_movelh_ps(lo, hi));
+  }
+  _mm_sfence();
+  convert_scalar(src + i, dst + i, n - i);
+}
+
+OGLER_TARGET("avx") void convert_avx(const double *src, float *dst, size_t n) {
+  size_t i = convert_head(src, dst, n, 32);
+  for (; i + 8 <= n; i += 8) {
+    auto lo = _mm256_cvtpd_ps(_mm256_loadu_pd(src + i));
+    auto hi = _mm256_cvtpd_ps(_mm256_loadu_pd(src + i + 4));
+    _mm256_stream_ps(dst + i, _mm256_set_m128(hi, lo));
+  }
+  _mm_sfence();
+  convert_scalar(src + i, dst + i, n - i);
+}
+
+OGLER_TARGET("avx512f")
+void convert_avx512(const double *src, float *dst, size_t n) {
+  size_t i = convert_head(src, dst, n, 64);
+  for (; i + 16 <= n; i += 16) {
+    auto lo = _mm512_cvtpd_ps(_mm512_loadu_pd(src + i));
+    auto hi = _mm512_cvtpd_ps(_mm512_loadu_pd(src + i + 8));
+    auto res = _mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(lo)),
+                                  _mm256_castps_pd(hi), 1);
+    _mm512_stream_ps(dst + i, _mm512_castpd_ps(res));
+  }
+  _mm_sfence();
+  convert_scalar(src + i, dst + i, n - i);
+}
+
+const ConvertToFloatImpl &get_impl() {
+  static ConvertToFloatImpl impl = convert_to_float_impls().back();
+  return impl;
+}
+} // namespace
+
+std::vector<ConvertToFloatImpl> convert_to_float_impls() {
+  // SSE2 is always available on x64
+  std::vector<ConvertToFloatImpl> impls{
+      {convert_scalar, "scalar"},
+      {convert_sse2, "sse2"},
+  };
+  auto features = detect_cpu_features();
+  if (features.avx) {
+    impls.push_back({convert_avx, "avx"});
+  }
+  if (features.avx512f) {
+    impls.push_back({convert_avx512, "avx512"});
+  }
+  return impls;
+}
+
+void convert_to_float(std::span<const double> src, std::span<float> dst) {
+  assert(dst.size() >= src.size());
+  get_impl().func(src.data(), dst.data(), src.size());
+}
+
+const char *convert_to_float_impl_name() { return get_impl().name; }
+} // namespace ogler
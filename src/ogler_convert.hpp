@@ -0,0 +1,52 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace ogler {
+
+// Narrows src into dst, which must be at least as long. Picks the widest
+// vector instruction set supported by the CPU at runtime. Uses non-temporal
+// stores, as the destination is expected to be mapped device memory that the
+// CPU won't read back.
+void convert_to_float(std::span<const double> src, std::span<float> dst);
+
+// Name of the implementation picked by convert_to_float, for diagnostics
+const char *convert_to_float_impl_name();
+
+struct ConvertToFloatImpl {
+  void (*func)(const double *src, float *dst, size_t n);
+  const char *name;
+};
+
+// Every implementation the CPU can run, starting from the scalar loop, for
+// comparing them. convert_to_float uses the last one.
+std::vector<ConvertToFloatImpl> convert_to_float_impls();
+} // namespace ogler
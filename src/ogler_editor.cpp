@@ -52,6 +52,8 @@ public:
     plugin.set_parameter(index, value);
   }
 
+  std::string memory_usage() { return plugin.get_memory_usage(); }
+
   const std::string &get_shader_source() { return plugin.get_shader_source(); }
   bool set_shader_source(const std::string &source) {
     plugin.set_shader_source(source);
@@ -76,14 +78,23 @@ public:
     return true;
   }
 
+  int get_frames_in_flight() { return plugin.get_frames_in_flight(); }
+  bool set_frames_in_flight(int frames) {
+    plugin.set_frames_in_flight(frames);
+    return true;
+  }
+
   SOM_PASSPORT_BEGIN_EX(ogler, EditorScripting)
-  SOM_FUNCS(SOM_FUNC(recompile), SOM_FUNC(set_parameter), )
+  SOM_FUNCS(SOM_FUNC(recompile), SOM_FUNC(set_parameter),
+            SOM_FUNC(memory_usage), )
   SOM_PROPS(SOM_VIRTUAL_PROP(shader_source, get_shader_source,
                              set_shader_source),
             SOM_VIRTUAL_PROP(zoom, get_zoom, set_zoom),
             SOM_VIRTUAL_PROP(editor_width, get_editor_width, set_editor_width),
             SOM_VIRTUAL_PROP(editor_height, get_editor_height,
-                             set_editor_height), )
+                             set_editor_height),
+            SOM_VIRTUAL_PROP(frames_in_flight, get_frames_in_flight,
+                             set_frames_in_flight), )
   SOM_PASSPORT_END
 };
 
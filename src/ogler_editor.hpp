@@ -45,8 +45,12 @@ public:
   virtual int get_height() = 0;
   virtual void set_width(int w) = 0;
   virtual void set_height(int h) = 0;
+  virtual int get_frames_in_flight() = 0;
+  virtual void set_frames_in_flight(int frames) = 0;
 
   virtual void set_parameter(size_t index, float value) = 0;
+  // Summary of the device memory used by all instances
+  virtual std::string get_memory_usage() = 0;
 };
 
 class Editor final : public SciterWindow<Editor> {
@@ -0,0 +1,146 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_pool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace ogler {
+
+void PoolReturn::operator()(PooledImage *image) const {
+  pool->release(std::unique_ptr<PooledImage>(image));
+}
+
+void PoolReturn::operator()(PooledBuffer *buffer) const {
+  pool->release(std::unique_ptr<PooledBuffer>(buffer));
+}
+
+ResourcePool::ResourcePool(VulkanContext &vulkan, size_t capacity)
+    : vulkan(vulkan), capacity(capacity) {}
+
+void ResourcePool::release(Idle resource) {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle_bytes += std::visit([](auto &r) { return r->memory.size(); }, resource);
+  idle.push_front(std::move(resource));
+  while (idle_bytes > capacity) {
+    idle_bytes -=
+        std::visit([](auto &r) { return r->memory.size(); }, idle.back());
+    idle.pop_back();
+  }
+}
+
+PooledImagePtr ResourcePool::acquire_image(vk::Format format, int width,
+                                           int height,
+                                           vk::ImageUsageFlags usage) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = std::find_if(idle.begin(), idle.end(), [&](Idle &resource) {
+      auto image = std::get_if<std::unique_ptr<PooledImage>>(&resource);
+      return image && (*image)->image.format == format &&
+             (*image)->image.width == width &&
+             (*image)->image.height == height && (*image)->usage == usage;
+    });
+    if (it != idle.end()) {
+      auto image = std::move(std::get<std::unique_ptr<PooledImage>>(*it));
+      idle.erase(it);
+      idle_bytes -= image->image.memory.size();
+      return PooledImagePtr(image.release(), PoolReturn{this});
+    }
+  }
+
+  auto image = vulkan.create_image(width, height, format,
+                                   vk::ImageTiling::eOptimal, usage);
+  auto view = vulkan.create_image_view(image, format);
+  return PooledImagePtr(new PooledImage{
+                            .image = std::move(image),
+                            .view = std::move(view),
+                            .usage = usage,
+                        },
+                        PoolReturn{this});
+}
+
+PooledBufferPtr
+ResourcePool::acquire_buffer(int size, vk::BufferUsageFlags usage,
+                             vk::MemoryPropertyFlags properties,
+                             vk::MemoryPropertyFlags preferred) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = std::find_if(idle.begin(), idle.end(), [&](Idle &resource) {
+      auto buffer = std::get_if<std::unique_ptr<PooledBuffer>>(&resource);
+      return buffer && (*buffer)->size == size && (*buffer)->usage == usage &&
+             (*buffer)->properties == properties &&
+             (*buffer)->preferred == preferred;
+    });
+    if (it != idle.end()) {
+      auto buffer = std::move(std::get<std::unique_ptr<PooledBuffer>>(*it));
+      idle.erase(it);
+      idle_bytes -= buffer->memory.size();
+      return PooledBufferPtr(buffer.release(), PoolReturn{this});
+    }
+  }
+
+  bool map = bool(properties & vk::MemoryPropertyFlagBits::eHostVisible);
+  auto buffer =
+      vulkan.create_buffer<char>({}, size, usage, vk::SharingMode::eExclusive,
+                                 properties, map, preferred);
+  return PooledBufferPtr(
+      new PooledBuffer(std::move(buffer), usage, properties, preferred),
+      PoolReturn{this});
+}
+
+HostImportCache::HostImportCache(VulkanContext &vulkan, size_t capacity)
+    : vulkan(vulkan), capacity(capacity) {}
+
+std::shared_ptr<HostBuffer>
+HostImportCache::import(std::span<char> data, vk::BufferUsageFlags usage) {
+  auto begin = reinterpret_cast<uintptr_t>(data.data());
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = std::ranges::find_if(entries, [&](const Entry &entry) {
+    return entry.begin == begin && entry.size == data.size() &&
+           entry.usage == usage;
+  });
+  if (it != entries.end()) {
+    entries.splice(entries.begin(), entries, it);
+    return it->buffer;
+  }
+
+  std::shared_ptr<HostBuffer> buffer;
+  if (auto imported = vulkan.import_host_memory(data, usage)) {
+    buffer = std::make_shared<HostBuffer>(std::move(*imported));
+  }
+  entries.push_front({
+      .begin = begin,
+      .size = data.size(),
+      .usage = usage,
+      .buffer = buffer,
+  });
+  if (entries.size() > capacity) {
+    entries.pop_back();
+  }
+  return buffer;
+}
+} // namespace ogler
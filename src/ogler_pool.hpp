@@ -0,0 +1,137 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include "vulkan_context.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <variant>
+
+namespace ogler {
+
+class ResourcePool;
+
+// A device-local image and its view, handed out by ResourcePool
+struct PooledImage {
+  Image image;
+  vk::raii::ImageView view;
+  vk::ImageUsageFlags usage;
+  // Layout the image was left in by its last user, so that the next one
+  // doesn't need to transition it again. Undefined for new images.
+  vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+};
+
+struct PooledBuffer : Buffer<char> {
+  vk::BufferUsageFlags usage;
+  vk::MemoryPropertyFlags properties;
+  vk::MemoryPropertyFlags preferred;
+
+  PooledBuffer(Buffer<char> &&buf, vk::BufferUsageFlags usage,
+               vk::MemoryPropertyFlags properties,
+               vk::MemoryPropertyFlags preferred)
+      : Buffer<char>(std::move(buf)), usage(usage), properties(properties),
+        preferred(preferred) {}
+};
+
+// Hands resources back to their pool instead of destroying them
+struct PoolReturn {
+  ResourcePool *pool;
+
+  void operator()(PooledImage *image) const;
+  void operator()(PooledBuffer *buffer) const;
+};
+
+using PooledImagePtr = std::unique_ptr<PooledImage, PoolReturn>;
+using PooledBufferPtr = std::unique_ptr<PooledBuffer, PoolReturn>;
+
+// Images and buffers that are no longer in use, shared by all instances.
+// Sources of different sizes and project resolution changes would otherwise
+// reallocate them over and over. Once the idle resources take more than
+// capacity bytes, the least recently released ones are destroyed.
+class ResourcePool {
+  friend struct PoolReturn;
+
+  using Idle =
+      std::variant<std::unique_ptr<PooledImage>, std::unique_ptr<PooledBuffer>>;
+
+  VulkanContext &vulkan;
+  std::mutex mutex;
+  // Most recently released first
+  std::list<Idle> idle;
+  size_t idle_bytes = 0;
+  size_t capacity;
+
+  void release(Idle resource);
+
+public:
+  ResourcePool(VulkanContext &vulkan, size_t capacity);
+
+  // Optimal tiling. Callers must only release images once the GPU is done
+  // with them, and record the layout they leave them in.
+  PooledImagePtr acquire_image(vk::Format format, int width, int height,
+                               vk::ImageUsageFlags usage);
+  // Mapped if the memory is host-visible
+  PooledBufferPtr acquire_buffer(int size, vk::BufferUsageFlags usage,
+                                 vk::MemoryPropertyFlags properties,
+                                 vk::MemoryPropertyFlags preferred = {});
+};
+
+// Imports of host memory, shared by all instances. REAPER recycles its
+// frames, so the same buffers keep coming back, and importing them again
+// every frame would allocate new memory objects each time. Failed imports
+// are remembered as well. Once there are more than capacity imports, the
+// least recently used ones are dropped.
+//
+// The memory of a recycled frame stays allocated, but callers must still keep
+// the frame alive while the GPU uses its import.
+class HostImportCache {
+  struct Entry {
+    uintptr_t begin;
+    size_t size;
+    vk::BufferUsageFlags usage;
+    std::shared_ptr<HostBuffer> buffer;
+  };
+
+  VulkanContext &vulkan;
+  std::mutex mutex;
+  // Most recently used first
+  std::list<Entry> entries;
+  size_t capacity;
+
+public:
+  HostImportCache(VulkanContext &vulkan, size_t capacity);
+
+  // Null if the memory can't be imported
+  std::shared_ptr<HostBuffer> import(std::span<char> data,
+                                     vk::BufferUsageFlags usage);
+};
+} // namespace ogler
@@ -0,0 +1,142 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_scheduler.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace ogler {
+
+SubmitScheduler::SubmitScheduler(VulkanContext &vulkan, uint32_t max_queues,
+                                 std::chrono::microseconds batch_window)
+    : device(vulkan.device), batch_window(batch_window) {
+  auto count = std::clamp(vulkan.queue_count, 1u, max_queues);
+  for (uint32_t i = 0; i < count; ++i) {
+    queues.emplace_back(new Queue{.queue = vulkan.get_queue(i)});
+  }
+}
+
+uint32_t SubmitScheduler::acquire_queue() {
+  std::unique_lock<std::mutex> lock(users_mutex);
+  auto it = std::min_element(
+      queues.begin(), queues.end(),
+      [](auto &a, auto &b) { return a->users < b->users; });
+  ++(*it)->users;
+  return static_cast<uint32_t>(std::distance(queues.begin(), it));
+}
+
+void SubmitScheduler::release_queue(uint32_t queue) {
+  std::unique_lock<std::mutex> lock(users_mutex);
+  --queues[queue]->users;
+}
+
+void SubmitScheduler::flush(Queue &q) {
+  if (q.pending.empty()) {
+    return;
+  }
+  q.queue.submit(
+      {
+          vk::SubmitInfo{
+              .commandBufferCount = static_cast<uint32_t>(q.pending.size()),
+              .pCommandBuffers = q.pending.data(),
+          },
+      },
+      q.pending_fences.back());
+  // Empty submissions signal their fence once everything before them is
+  // done, which is when the batch is
+  q.pending_fences.pop_back();
+  for (auto fence : q.pending_fences) {
+    q.queue.submit({}, fence);
+  }
+  q.flushed = q.submitted;
+  q.pending.clear();
+  q.pending_fences.clear();
+  q.flushed_cv.notify_all();
+}
+
+uint64_t SubmitScheduler::submit(uint32_t queue,
+                                 std::span<const vk::SubmitInfo> submits,
+                                 vk::Fence fence) {
+  auto &q = *queues[queue];
+  std::unique_lock<std::mutex> lock(q.mutex);
+  // Keeps serials in the order the driver sees the submissions
+  flush(q);
+  q.queue.submit({static_cast<uint32_t>(submits.size()), submits.data()},
+                 fence);
+  q.flushed = ++q.submitted;
+  return q.submitted;
+}
+
+uint64_t SubmitScheduler::submit_batched(uint32_t queue, vk::CommandBuffer cmd,
+                                         vk::Fence fence) {
+  if (batch_window.count() == 0) {
+    vk::SubmitInfo submit_info{
+        .commandBufferCount = 1,
+        .pCommandBuffers = &cmd,
+    };
+    return submit(queue, {&submit_info, 1}, fence);
+  }
+
+  auto &q = *queues[queue];
+  std::unique_lock<std::mutex> lock(q.mutex);
+  q.pending.push_back(cmd);
+  q.pending_fences.push_back(fence);
+  auto serial = ++q.submitted;
+  if (q.pending.size() >= q.users) {
+    // Nobody else is left to wait for. Instances that stopped rendering only
+    // hold the batch back until the window ends.
+    flush(q);
+  } else if (!q.collecting) {
+    // The first thread to submit waits for the others, and submits for all
+    q.collecting = true;
+    q.flushed_cv.wait_for(lock, batch_window,
+                          [&]() { return q.flushed >= serial; });
+    q.collecting = false;
+    flush(q);
+  }
+  return serial;
+}
+
+void SubmitScheduler::wait(uint32_t queue, uint64_t serial, vk::Fence fence) {
+  auto &q = *queues[queue];
+  std::unique_lock<std::mutex> lock(q.mutex);
+  q.flushed_cv.wait(lock, [&]() { return q.flushed >= serial; });
+  lock.unlock();
+
+  auto res = device.waitForFences({fence}, true, uint64_t(-1));
+  assert(res == vk::Result::eSuccess);
+
+  lock.lock();
+  q.completed = std::max(q.completed, serial);
+}
+
+bool SubmitScheduler::is_complete(uint32_t queue, uint64_t serial) {
+  auto &q = *queues[queue];
+  std::unique_lock<std::mutex> lock(q.mutex);
+  return q.completed >= serial;
+}
+} // namespace ogler
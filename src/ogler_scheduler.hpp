@@ -0,0 +1,106 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include "vulkan_context.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace ogler {
+
+// Spreads the instances over the queues of the compute family, and
+// serializes submissions to each queue. REAPER renders tracks on several
+// threads, and a VkQueue can't be submitted to from more than one at once.
+//
+// An instance keeps the same queue for its whole life, so that its own
+// frames run in order. Work on different queues isn't ordered: resources
+// shared between instances must check is_complete before they use what
+// another queue wrote.
+//
+// With a batch window, frames submitted to the same queue within the window
+// go out with a single vkQueueSubmit. The window closes early once every
+// instance on the queue has submitted.
+class SubmitScheduler {
+  struct Queue {
+    vk::raii::Queue queue;
+    std::mutex mutex;
+    // Serial of the last submission, of the last one handed to the driver,
+    // and of the last one known to be done
+    uint64_t submitted = 0;
+    uint64_t flushed = 0;
+    uint64_t completed = 0;
+    std::atomic<size_t> users = 0;
+
+    // Waiting for the batch window to end, with the fences to signal
+    std::vector<vk::CommandBuffer> pending;
+    std::vector<vk::Fence> pending_fences;
+    bool collecting = false;
+    std::condition_variable flushed_cv;
+  };
+
+  vk::raii::Device &device;
+  std::chrono::microseconds batch_window;
+  std::mutex users_mutex;
+  std::vector<std::unique_ptr<Queue>> queues;
+
+  // Hands the pending submissions to the driver. Called with q.mutex held.
+  void flush(Queue &q);
+
+public:
+  // A batch window of zero submits every frame on its own
+  SubmitScheduler(VulkanContext &vulkan, uint32_t max_queues,
+                  std::chrono::microseconds batch_window);
+
+  uint32_t num_queues() const { return static_cast<uint32_t>(queues.size()); }
+
+  // Returns the queue with the fewest users
+  uint32_t acquire_queue();
+  void release_queue(uint32_t queue);
+
+  // Returns the serial of the submission, to be passed to wait
+  uint64_t submit(uint32_t queue, std::span<const vk::SubmitInfo> submits,
+                  vk::Fence fence);
+  // Like submit, but the command buffer may be batched with other threads',
+  // and only handed to the driver once the batch is. The submission must be
+  // waited for with wait, not on the fence directly.
+  uint64_t submit_batched(uint32_t queue, vk::CommandBuffer cmd,
+                          vk::Fence fence);
+  // Blocks until the submission is done. fence is the one it was submitted
+  // with.
+  void wait(uint32_t queue, uint64_t serial, vk::Fence fence);
+  // Whether everything submitted to the queue up to serial is done, as far
+  // as wait has seen
+  bool is_complete(uint32_t queue, uint64_t serial);
+};
+} // namespace ogler
@@ -0,0 +1,80 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_staging.hpp"
+
+#include <algorithm>
+
+namespace ogler {
+
+static vk::DeviceSize get_staging_alignment(VulkanContext &vulkan) {
+  auto limits = vulkan.phys_device.getProperties().limits;
+  return std::max({vk::DeviceSize(16), limits.minUniformBufferOffsetAlignment,
+                   limits.minStorageBufferOffsetAlignment});
+}
+
+StagingRing::StagingRing(VulkanContext &vulkan, vk::DeviceSize size)
+    : buffer(vulkan.create_buffer<char>(
+          {}, size, usage, vk::SharingMode::eExclusive,
+          vk::MemoryPropertyFlagBits::eHostVisible |
+              vk::MemoryPropertyFlagBits::eHostCoherent)),
+      alignment(get_staging_alignment(vulkan)) {}
+
+std::optional<StagingRange> StagingRing::allocate(vk::DeviceSize size) {
+  vk::DeviceSize capacity = buffer.size;
+  std::unique_lock<std::mutex> lock(mutex);
+  auto start = (head + alignment - 1) / alignment * alignment;
+  // Ranges never wrap around the end of the buffer
+  if (start % capacity + size > capacity) {
+    start = (start + capacity - 1) / capacity * capacity;
+  }
+  if (start + size - tail > capacity) {
+    return std::nullopt;
+  }
+
+  head = start + size;
+  regions.push_back({.end = head, .released = false});
+  auto offset = start % capacity;
+  return StagingRange{
+      .buffer = *buffer.buffer,
+      .offset = offset,
+      .map = buffer.map.subspan(offset, size),
+      .id = first_id + regions.size() - 1,
+  };
+}
+
+void StagingRing::release(std::span<const uint64_t> ids) {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (auto id : ids) {
+    regions[id - first_id].released = true;
+  }
+  while (!regions.empty() && regions.front().released) {
+    tail = regions.front().end;
+    regions.pop_front();
+    ++first_id;
+  }
+}
+} // namespace ogler
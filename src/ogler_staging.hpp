@@ -0,0 +1,85 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include "vulkan_context.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <span>
+
+namespace ogler {
+
+// Part of a staging buffer, written by the CPU and then read by the GPU
+struct StagingRange {
+  vk::Buffer buffer;
+  vk::DeviceSize offset;
+  std::span<char> map;
+  // Identifies the range to StagingRing::release
+  uint64_t id;
+};
+
+// A single persistently mapped buffer that all instances stage their
+// uploads in: gmem, input frames and uniforms. Space is handed out in order,
+// and is reused once every range allocated before it has been released, so
+// frames must release their ranges as soon as the GPU is done with them.
+class StagingRing {
+  Buffer<char> buffer;
+  // Suitable for any use of the ranges: texel copies, storage and uniform
+  // buffers
+  vk::DeviceSize alignment;
+
+  struct Region {
+    uint64_t end;
+    bool released;
+  };
+
+  std::mutex mutex;
+  // Positions only ever grow, the offset into the buffer is the position
+  // modulo its size. Space between tail and head is in use.
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  // Ranges that haven't been reused yet, the first one has id first_id
+  std::deque<Region> regions;
+  uint64_t first_id = 0;
+
+public:
+  static constexpr vk::BufferUsageFlags usage =
+      vk::BufferUsageFlagBits::eTransferSrc |
+      vk::BufferUsageFlagBits::eStorageBuffer |
+      vk::BufferUsageFlagBits::eUniformBuffer;
+
+  StagingRing(VulkanContext &vulkan, vk::DeviceSize size);
+
+  // Returns nullopt if there isn't enough space until more ranges are
+  // released
+  std::optional<StagingRange> allocate(vk::DeviceSize size);
+  void release(std::span<const uint64_t> ids);
+};
+} // namespace ogler
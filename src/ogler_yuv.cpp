@@ -0,0 +1,381 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "ogler_yuv.hpp"
+#include "compile_shader.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <variant>
+
+namespace ogler {
+
+static constexpr uint32_t workgroup_size = 8;
+
+static constexpr const char *decode_shader = R"(
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(push_constant) uniform Layout {
+  uint width;
+  uint height;
+  uint offset;
+  uint rowspan;
+  uint chroma_rowspan;
+  uint v_offset;
+  uint u_offset;
+};
+layout(binding = 0) buffer readonly Source {
+  uint src[];
+};
+layout(binding = 1, rgba8) uniform writeonly image2D dst;
+
+uint read_byte(uint i) {
+  return (src[i >> 2] >> ((i & 3) * 8)) & 0xff;
+}
+
+// BT.601, limited range
+vec3 yuv_to_rgb(uint y, uint u, uint v) {
+  float l = (float(y) - 16.0) / 219.0;
+  float cb = (float(u) - 128.0) / 224.0;
+  float cr = (float(v) - 128.0) / 224.0;
+  return clamp(vec3(l + 1.402 * cr,
+                    l - 0.344136 * cb - 0.714136 * cr,
+                    l + 1.772 * cb),
+               0.0, 1.0);
+}
+
+void main() {
+  uvec2 p = gl_GlobalInvocationID.xy;
+  if (any(greaterThanEqual(p, uvec2(width, height)))) {
+    return;
+  }
+#ifdef OGLER_YV12
+  uint y = read_byte(offset + p.y * rowspan + p.x);
+  uint chroma_row = min(p.y / 2, max(height / 2, 1u) - 1);
+  uint chroma = chroma_row * chroma_rowspan + p.x / 2;
+  uint u = read_byte(u_offset + chroma);
+  uint v = read_byte(v_offset + chroma);
+#else
+  uint pair = offset + p.y * rowspan + (p.x & ~1u) * 2;
+  uint y = read_byte(pair + (p.x & 1) * 2);
+  uint u = read_byte(pair + 1);
+  uint v = read_byte(pair + 3);
+#endif
+  imageStore(dst, ivec2(p), vec4(yuv_to_rgb(y, u, v), 1.0));
+}
+)";
+
+static constexpr const char *encode_shader = R"(
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(push_constant) uniform Layout {
+  uint width;
+  uint height;
+  uint offset;
+  uint rowspan;
+  uint chroma_rowspan;
+  uint v_offset;
+  uint u_offset;
+};
+layout(binding = 0) buffer readonly Source {
+  uint src[];
+};
+layout(binding = 1) buffer writeonly Destination {
+  uint dst[];
+};
+
+// Pixels past the edges repeat the last row and column
+vec3 read_rgb(uint x, uint y) {
+  uint i = min(y, height - 1) * width + min(x, width - 1);
+  return unpackUnorm4x8(src[i]).zyx;
+}
+
+// BT.601, limited range
+uint luma(vec3 c) {
+  float y = 16.0 + 219.0 * dot(c, vec3(0.299, 0.587, 0.114));
+  return uint(clamp(round(y), 0.0, 255.0));
+}
+
+uvec2 chroma(vec3 c) {
+  vec2 uv = 128.0 + 224.0 * vec2(dot(c, vec3(-0.168736, -0.331264, 0.5)),
+                                 dot(c, vec3(0.5, -0.418688, -0.081312)));
+  return uvec2(clamp(round(uv), 0.0, 255.0));
+}
+
+void main() {
+#ifdef OGLER_YV12
+  // Each invocation covers 8x2 pixels: two words of Y on each row, and a
+  // word each of V and U
+  uint x0 = gl_GlobalInvocationID.x * 8;
+  uint y0 = gl_GlobalInvocationID.y * 2;
+  if (x0 >= width || y0 >= height) {
+    return;
+  }
+  uint y_words[4] = uint[4](0u, 0u, 0u, 0u);
+  uvec2 uv_words = uvec2(0);
+  for (uint i = 0; i < 8; i += 2) {
+    vec3 c00 = read_rgb(x0 + i, y0);
+    vec3 c10 = read_rgb(x0 + i + 1, y0);
+    vec3 c01 = read_rgb(x0 + i, y0 + 1);
+    vec3 c11 = read_rgb(x0 + i + 1, y0 + 1);
+    uint shift = (i % 4) * 8;
+    y_words[i / 4] |= (luma(c00) | (luma(c10) << 8)) << shift;
+    y_words[2 + i / 4] |= (luma(c01) | (luma(c11) << 8)) << shift;
+    uv_words |= chroma((c00 + c10 + c01 + c11) / 4.0) << ((i / 2) * 8);
+  }
+  for (uint row = 0; row < 2 && y0 + row < height; ++row) {
+    uint i = (offset + (y0 + row) * rowspan + x0) / 4;
+    dst[i] = y_words[row * 2];
+    dst[i + 1] = y_words[row * 2 + 1];
+  }
+  if (y0 / 2 < height / 2) {
+    uint chroma_index = (y0 / 2) * chroma_rowspan + x0 / 2;
+    dst[(v_offset + chroma_index) / 4] = uv_words.y;
+    dst[(u_offset + chroma_index) / 4] = uv_words.x;
+  }
+#else
+  // Each invocation covers a pair of pixels, packed as Y0 U Y1 V
+  uint x0 = gl_GlobalInvocationID.x * 2;
+  uint y = gl_GlobalInvocationID.y;
+  if (x0 >= width || y >= height) {
+    return;
+  }
+  vec3 c0 = read_rgb(x0, y);
+  vec3 c1 = read_rgb(x0 + 1, y);
+  uvec2 uv = chroma((c0 + c1) / 2.0);
+  dst[(offset + y * rowspan + x0 * 2) / 4] =
+      luma(c0) | (uv.x << 8) | (luma(c1) << 16) | (uv.y << 24);
+#endif
+}
+)";
+
+static vk::raii::DescriptorSetLayout
+create_descriptor_set_layout(VulkanContext &vulkan,
+                             vk::DescriptorType second_binding_type) {
+  std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+      // Source
+      {
+          .binding = 0,
+          .descriptorType = vk::DescriptorType::eStorageBuffer,
+          .descriptorCount = 1,
+          .stageFlags = vk::ShaderStageFlagBits::eCompute,
+      },
+      // Destination
+      {
+          .binding = 1,
+          .descriptorType = second_binding_type,
+          .descriptorCount = 1,
+          .stageFlags = vk::ShaderStageFlagBits::eCompute,
+      },
+  };
+  return vulkan.device.createDescriptorSetLayout({
+      .bindingCount = static_cast<uint32_t>(bindings.size()),
+      .pBindings = bindings.data(),
+  });
+}
+
+static vk::raii::Pipeline create_pipeline(VulkanContext &vulkan,
+                                          vk::raii::PipelineCache &cache,
+                                          vk::raii::PipelineLayout &layout,
+                                          const char *defines,
+                                          const char *source) {
+  auto result = compile_shader(
+      {
+          {"<version>", "#version 460\n"},
+          {"<defines>", defines},
+          {"<source>", source},
+      },
+      -1);
+  if (auto error = std::get_if<std::string>(&result)) {
+    throw std::runtime_error(*error);
+  }
+  auto module = vulkan.create_shader_module(
+      std::get<ShaderData>(result).spirv_code);
+  return vulkan.create_compute_pipeline(module, "main", layout, cache);
+}
+
+YuvConverter::YuvConverter(VulkanContext &vulkan,
+                           vk::raii::PipelineCache &cache)
+    : vulkan(vulkan),
+      decode_set_layout(create_descriptor_set_layout(
+          vulkan, vk::DescriptorType::eStorageImage)),
+      decode_layout(vulkan.create_pipeline_layout(decode_set_layout,
+                                                  sizeof(YuvLayout))),
+      decode_yv12(create_pipeline(vulkan, cache, decode_layout,
+                                  "#define OGLER_YV12\n", decode_shader)),
+      decode_yuy2(
+          create_pipeline(vulkan, cache, decode_layout, "", decode_shader)),
+      encode_set_layout(create_descriptor_set_layout(
+          vulkan, vk::DescriptorType::eStorageBuffer)),
+      encode_layout(vulkan.create_pipeline_layout(encode_set_layout,
+                                                  sizeof(YuvLayout))),
+      encode_yv12(create_pipeline(vulkan, cache, encode_layout,
+                                  "#define OGLER_YV12\n", encode_shader)),
+      encode_yuy2(
+          create_pipeline(vulkan, cache, encode_layout, "", encode_shader)) {}
+
+vk::raii::DescriptorPool
+YuvConverter::create_descriptor_pool(uint32_t num_sets) {
+  std::vector<vk::DescriptorPoolSize> pool_sizes = {
+      {
+          .type = vk::DescriptorType::eStorageBuffer,
+          .descriptorCount = num_sets * 2,
+      },
+      {
+          .type = vk::DescriptorType::eStorageImage,
+          .descriptorCount = num_sets,
+      },
+  };
+  return vulkan.device.createDescriptorPool({
+      .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+      .maxSets = num_sets,
+      .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
+      .pPoolSizes = pool_sizes.data(),
+  });
+}
+
+static std::vector<vk::raii::DescriptorSet>
+allocate_descriptor_sets(VulkanContext &vulkan, vk::raii::DescriptorPool &pool,
+                         vk::raii::DescriptorSetLayout &layout,
+                         uint32_t num_sets) {
+  std::vector<vk::DescriptorSetLayout> layouts(num_sets, *layout);
+  return vulkan.device.allocateDescriptorSets({
+      .descriptorPool = *pool,
+      .descriptorSetCount = num_sets,
+      .pSetLayouts = layouts.data(),
+  });
+}
+
+std::vector<vk::raii::DescriptorSet>
+YuvConverter::create_decode_descriptor_sets(vk::raii::DescriptorPool &pool,
+                                            uint32_t num_sets) {
+  return allocate_descriptor_sets(vulkan, pool, decode_set_layout, num_sets);
+}
+
+std::vector<vk::raii::DescriptorSet>
+YuvConverter::create_encode_descriptor_sets(vk::raii::DescriptorPool &pool,
+                                            uint32_t num_sets) {
+  return allocate_descriptor_sets(vulkan, pool, encode_set_layout, num_sets);
+}
+
+void YuvConverter::record_decode(vk::raii::CommandBuffer &cmd,
+                                 vk::raii::DescriptorSet &descriptor_set,
+                                 YuvFormat format, vk::Buffer src,
+                                 const YuvLayout &layout, vk::ImageView dst) {
+  vk::DescriptorBufferInfo src_info{
+      .buffer = src,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE,
+  };
+  vk::DescriptorImageInfo dst_info{
+      .imageView = dst,
+      .imageLayout = vk::ImageLayout::eGeneral,
+  };
+  vulkan.write_descriptor_sets({
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 0,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageBuffer,
+          .pBufferInfo = &src_info,
+      },
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 1,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageImage,
+          .pImageInfo = &dst_info,
+      },
+  });
+
+  auto &pipeline = format == YuvFormat::YV12 ? decode_yv12 : decode_yuy2;
+  cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+  cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *decode_layout, 0,
+                         {*descriptor_set}, {});
+  cmd.pushConstants<YuvLayout>(*decode_layout,
+                               vk::ShaderStageFlagBits::eCompute, 0, {layout});
+  cmd.dispatch((layout.width + workgroup_size - 1) / workgroup_size,
+               (layout.height + workgroup_size - 1) / workgroup_size, 1);
+}
+
+bool YuvConverter::can_encode(YuvFormat format, const YuvLayout &layout) {
+  if (format == YuvFormat::YV12) {
+    auto padded_width = (layout.width + 7) & ~uint32_t(7);
+    return layout.offset % 4 == 0 && layout.rowspan % 8 == 0 &&
+           layout.rowspan >= padded_width &&
+           layout.chroma_rowspan == layout.rowspan / 2;
+  } else {
+    auto padded_width = (layout.width + 1) & ~uint32_t(1);
+    return layout.offset % 4 == 0 && layout.rowspan % 4 == 0 &&
+           layout.rowspan >= padded_width * 2;
+  }
+}
+
+void YuvConverter::record_encode(vk::raii::CommandBuffer &cmd,
+                                 vk::raii::DescriptorSet &descriptor_set,
+                                 YuvFormat format, vk::Buffer src,
+                                 vk::Buffer dst, const YuvLayout &layout) {
+  vk::DescriptorBufferInfo src_info{
+      .buffer = src,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE,
+  };
+  vk::DescriptorBufferInfo dst_info{
+      .buffer = dst,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE,
+  };
+  vulkan.write_descriptor_sets({
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 0,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageBuffer,
+          .pBufferInfo = &src_info,
+      },
+      {
+          .dstSet = *descriptor_set,
+          .dstBinding = 1,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageBuffer,
+          .pBufferInfo = &dst_info,
+      },
+  });
+
+  // Invocations cover 8x2 pixels for YV12, 2x1 for YUY2
+  bool yv12 = format == YuvFormat::YV12;
+  uint32_t blocks_x = (layout.width + (yv12 ? 7 : 1)) / (yv12 ? 8 : 2);
+  uint32_t blocks_y = yv12 ? (layout.height + 1) / 2 : layout.height;
+  cmd.bindPipeline(vk::PipelineBindPoint::eCompute,
+                   yv12 ? *encode_yv12 : *encode_yuy2);
+  cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *encode_layout, 0,
+                         {*descriptor_set}, {});
+  cmd.pushConstants<YuvLayout>(*encode_layout,
+                               vk::ShaderStageFlagBits::eCompute, 0, {layout});
+  cmd.dispatch((blocks_x + workgroup_size - 1) / workgroup_size,
+               (blocks_y + workgroup_size - 1) / workgroup_size, 1);
+}
+} // namespace ogler
@@ -0,0 +1,100 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#include "vulkan_context.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace ogler {
+
+enum class YuvFormat {
+  // Planar: a Y plane followed by V and U planes at half the resolution
+  YV12,
+  // Packed: Y0 U Y1 V for each pair of pixels
+  YUY2,
+};
+
+// Where the planes of a YUV frame are in a buffer, in bytes. The chroma
+// fields are only used by planar formats.
+struct YuvLayout {
+  uint32_t width;
+  uint32_t height;
+  uint32_t offset;
+  uint32_t rowspan;
+  uint32_t chroma_rowspan;
+  uint32_t v_offset;
+  uint32_t u_offset;
+};
+
+// Converts between REAPER's YUV frames and RGBA on the GPU, so that only the
+// YUV data crosses the bus, and REAPER doesn't have to convert it on the CPU
+class YuvConverter {
+  VulkanContext &vulkan;
+  vk::raii::DescriptorSetLayout decode_set_layout;
+  vk::raii::PipelineLayout decode_layout;
+  vk::raii::Pipeline decode_yv12;
+  vk::raii::Pipeline decode_yuy2;
+  vk::raii::DescriptorSetLayout encode_set_layout;
+  vk::raii::PipelineLayout encode_layout;
+  vk::raii::Pipeline encode_yv12;
+  vk::raii::Pipeline encode_yuy2;
+
+public:
+  // Throws std::runtime_error if the conversion shaders can't be built
+  YuvConverter(VulkanContext &vulkan, vk::raii::PipelineCache &cache);
+
+  // Large enough for num_sets descriptor sets of either kind
+  vk::raii::DescriptorPool create_descriptor_pool(uint32_t num_sets);
+  std::vector<vk::raii::DescriptorSet>
+  create_decode_descriptor_sets(vk::raii::DescriptorPool &pool,
+                                uint32_t num_sets);
+  std::vector<vk::raii::DescriptorSet>
+  create_encode_descriptor_sets(vk::raii::DescriptorPool &pool,
+                                uint32_t num_sets);
+
+  // Records the conversion of the YUV frame in src into dst, which must be in
+  // the General layout
+  void record_decode(vk::raii::CommandBuffer &cmd,
+                     vk::raii::DescriptorSet &descriptor_set,
+                     YuvFormat format, vk::Buffer src, const YuvLayout &layout,
+                     vk::ImageView dst);
+
+  // Whether record_encode can write a frame with this layout. Rows and
+  // planes must start on a word, and leave room for the words the shader
+  // writes past the last pixel.
+  static bool can_encode(YuvFormat format, const YuvLayout &layout);
+
+  // Records the conversion of the BGRA pixels in src, packed at layout.width
+  // pixels per row, into a YUV frame in dst
+  void record_encode(vk::raii::CommandBuffer &cmd,
+                     vk::raii::DescriptorSet &descriptor_set,
+                     YuvFormat format, vk::Buffer src, vk::Buffer dst,
+                     const YuvLayout &layout);
+};
+} // namespace ogler
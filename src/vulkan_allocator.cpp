@@ -0,0 +1,213 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#include "vulkan_allocator.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <optional>
+#include <utility>
+
+namespace ogler {
+
+static constexpr vk::DeviceSize default_block_size = vk::DeviceSize(64) << 20;
+
+static vk::DeviceSize align_up(vk::DeviceSize value, vk::DeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+Allocation::Allocation(MemoryAllocator *allocator, MemoryBlock *block,
+                       vk::DeviceSize offset, vk::DeviceSize size)
+    : allocator(allocator), block(block), offset_(offset), size_(size) {}
+
+Allocation::Allocation(Allocation &&other) noexcept
+    : allocator(std::exchange(other.allocator, nullptr)),
+      block(std::exchange(other.block, nullptr)), offset_(other.offset_),
+      size_(other.size_) {}
+
+Allocation &Allocation::operator=(Allocation &&other) noexcept {
+  if (this != &other) {
+    if (allocator) {
+      allocator->free(block, offset_, size_);
+    }
+    allocator = std::exchange(other.allocator, nullptr);
+    block = std::exchange(other.block, nullptr);
+    offset_ = other.offset_;
+    size_ = other.size_;
+  }
+  return *this;
+}
+
+Allocation::~Allocation() {
+  if (allocator) {
+    allocator->free(block, offset_, size_);
+  }
+}
+
+MemoryAllocator::MemoryAllocator(vk::raii::PhysicalDevice &phys_device,
+                                 vk::raii::Device &device)
+    : device(device), props(phys_device.getMemoryProperties()),
+      granularity(phys_device.getProperties().limits.bufferImageGranularity) {}
+
+vk::DeviceSize MemoryAllocator::block_size(uint32_t type_index) const {
+  // Small heaps, like the host-visible window into VRAM, are shared with
+  // everything else running on the GPU
+  auto heap_index = props.memoryTypes[type_index].heapIndex;
+  auto heap_size = props.memoryHeaps[heap_index].size;
+  return std::min(default_block_size, std::bit_floor(heap_size / 8));
+}
+
+Allocation MemoryAllocator::allocate(const vk::MemoryRequirements &reqs,
+                                     vk::MemoryPropertyFlags required,
+                                     vk::MemoryPropertyFlags preferred) {
+  std::optional<uint32_t> type_index;
+  int best_score = -1;
+  for (uint32_t i = 0; i < props.memoryTypeCount; ++i) {
+    auto flags = props.memoryTypes[i].propertyFlags;
+    if (!(reqs.memoryTypeBits & (1u << i)) || (flags & required) != required) {
+      continue;
+    }
+    auto score = std::popcount(
+        static_cast<VkMemoryPropertyFlags>(flags & preferred));
+    if (score > best_score) {
+      best_score = score;
+      type_index = i;
+    }
+  }
+  if (!type_index) {
+    throw vk::OutOfDeviceMemoryError("No suitable memory type");
+  }
+
+  auto alignment = std::max(reqs.alignment, granularity);
+  auto size = align_up(reqs.size, granularity);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  for (auto &block : blocks) {
+    if (block->type_index != *type_index || block->dedicated) {
+      continue;
+    }
+    for (auto it = block->free_ranges.begin(); it != block->free_ranges.end();
+         ++it) {
+      auto [range_offset, range_size] = *it;
+      auto offset = align_up(range_offset, alignment);
+      if (offset + size > range_offset + range_size) {
+        continue;
+      }
+      // Keep what's left on either side of the allocation
+      block->free_ranges.erase(it);
+      if (offset > range_offset) {
+        block->free_ranges[range_offset] = offset - range_offset;
+      }
+      if (offset + size < range_offset + range_size) {
+        block->free_ranges[offset + size] =
+            range_offset + range_size - (offset + size);
+      }
+      ++block->num_allocations;
+      ++totals.num_allocations;
+      totals.used_bytes += size;
+      return Allocation(this, block.get(), offset, size);
+    }
+  }
+
+  auto new_block_size = block_size(*type_index);
+  bool dedicated = size > new_block_size / 2;
+  if (dedicated) {
+    new_block_size = size;
+  }
+  auto memory = device.allocateMemory({
+      .allocationSize = new_block_size,
+      .memoryTypeIndex = *type_index,
+  });
+  char *mapped = nullptr;
+  if (props.memoryTypes[*type_index].propertyFlags &
+      vk::MemoryPropertyFlagBits::eHostVisible) {
+    mapped = static_cast<char *>(memory.mapMemory(0, VK_WHOLE_SIZE));
+  }
+  auto &block = blocks.emplace_back(new MemoryBlock{
+      .memory = std::move(memory),
+      .type_index = *type_index,
+      .size = new_block_size,
+      .mapped = mapped,
+      .dedicated = dedicated,
+      .num_allocations = 1,
+  });
+  if (size < new_block_size) {
+    block->free_ranges[size] = new_block_size - size;
+  }
+  ++totals.num_blocks;
+  ++totals.num_allocations;
+  totals.reserved_bytes += new_block_size;
+  totals.used_bytes += size;
+  return Allocation(this, block.get(), 0, size);
+}
+
+void MemoryAllocator::free(MemoryBlock *block, vk::DeviceSize offset,
+                           vk::DeviceSize size) {
+  std::unique_lock<std::mutex> lock(mutex);
+  --block->num_allocations;
+  --totals.num_allocations;
+  totals.used_bytes -= size;
+
+  // Merge with the neighbouring free ranges
+  auto next = block->free_ranges.lower_bound(offset);
+  if (next != block->free_ranges.end() && offset + size == next->first) {
+    size += next->second;
+    next = block->free_ranges.erase(next);
+  }
+  if (next != block->free_ranges.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      block->free_ranges.erase(prev);
+    }
+  }
+  block->free_ranges[offset] = size;
+
+  if (block->num_allocations > 0) {
+    return;
+  }
+  // Keep one empty block of each type around, so that resources that are
+  // recreated together, e.g. on resize, don't go back to the driver
+  bool keep = !block->dedicated &&
+              std::none_of(blocks.begin(), blocks.end(), [&](auto &other) {
+                return other.get() != block &&
+                       other->type_index == block->type_index &&
+                       !other->dedicated && other->num_allocations == 0;
+              });
+  if (!keep) {
+    totals.reserved_bytes -= block->size;
+    --totals.num_blocks;
+    std::erase_if(blocks, [&](auto &other) { return other.get() == block; });
+  }
+}
+
+MemoryStats MemoryAllocator::stats() {
+  std::unique_lock<std::mutex> lock(mutex);
+  return totals;
+}
+} // namespace ogler
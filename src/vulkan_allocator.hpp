@@ -0,0 +1,121 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+#pragma once
+
+#define VULKAN_HPP_NO_STRUCT_CONSTRUCTORS
+#include <vulkan/vulkan_raii.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ogler {
+
+class MemoryAllocator;
+
+struct MemoryBlock {
+  vk::raii::DeviceMemory memory;
+  uint32_t type_index;
+  vk::DeviceSize size;
+  // Mapped for the lifetime of the block if the memory type is host-visible
+  char *mapped;
+  // Holds a single allocation that was too large to share a block
+  bool dedicated;
+  // Unused ranges, size by offset
+  std::map<vk::DeviceSize, vk::DeviceSize> free_ranges;
+  size_t num_allocations = 0;
+};
+
+// A range of a MemoryBlock, handed back to the allocator when destroyed
+class Allocation {
+  MemoryAllocator *allocator = nullptr;
+  MemoryBlock *block = nullptr;
+  vk::DeviceSize offset_ = 0;
+  vk::DeviceSize size_ = 0;
+
+public:
+  Allocation() = default;
+  Allocation(MemoryAllocator *allocator, MemoryBlock *block,
+             vk::DeviceSize offset, vk::DeviceSize size);
+  Allocation(Allocation &&other) noexcept;
+  Allocation &operator=(Allocation &&other) noexcept;
+  ~Allocation();
+
+  vk::DeviceMemory memory() const { return *block->memory; }
+  vk::DeviceSize offset() const { return offset_; }
+  vk::DeviceSize size() const { return size_; }
+  // Null unless the memory is host-visible
+  char *mapped() const {
+    return block->mapped ? block->mapped + offset_ : nullptr;
+  }
+};
+
+struct MemoryStats {
+  size_t num_blocks;
+  size_t num_allocations;
+  // Allocated from the driver
+  vk::DeviceSize reserved_bytes;
+  // Handed out to resources
+  vk::DeviceSize used_bytes;
+};
+
+// Sub-allocates resources from large blocks of device memory, one set of
+// blocks per memory type. Each instance creates many small resources, so
+// allocating each of them on its own quickly gets close to
+// maxMemoryAllocationCount.
+class MemoryAllocator {
+  friend class Allocation;
+
+  vk::raii::Device &device;
+  vk::PhysicalDeviceMemoryProperties props;
+  // Alignment that keeps linear and optimal resources apart
+  vk::DeviceSize granularity;
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<MemoryBlock>> blocks;
+  MemoryStats totals{};
+
+  vk::DeviceSize block_size(uint32_t type_index) const;
+  void free(MemoryBlock *block, vk::DeviceSize offset, vk::DeviceSize size);
+
+public:
+  MemoryAllocator(vk::raii::PhysicalDevice &phys_device,
+                  vk::raii::Device &device);
+
+  // Uses a memory type allowed by reqs with all of the required properties,
+  // preferring the one with most of the preferred ones. Throws
+  // vk::OutOfDeviceMemoryError if there is none.
+  Allocation allocate(const vk::MemoryRequirements &reqs,
+                      vk::MemoryPropertyFlags required,
+                      vk::MemoryPropertyFlags preferred = {});
+
+  MemoryStats stats();
+};
+} // namespace ogler
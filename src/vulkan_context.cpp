@@ -26,6 +26,12 @@
 
 #include "vulkan_context.hpp"
 
+#include <array>
+#include <bit>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
@@ -35,6 +41,27 @@
 
 namespace ogler {
 
+// Instance and device extensions needed to import host memory, the instance
+// ones are core since Vulkan 1.1
+static constexpr std::array host_import_instance_extensions{
+    "VK_KHR_get_physical_device_properties2",
+    "VK_KHR_external_memory_capabilities",
+};
+static constexpr std::array host_import_device_extensions{
+    "VK_KHR_external_memory",
+    "VK_EXT_external_memory_host",
+};
+
+template <size_t N>
+static bool has_extensions(const std::vector<vk::ExtensionProperties> &props,
+                           const std::array<const char *, N> &names) {
+  return std::all_of(names.begin(), names.end(), [&](const char *name) {
+    return std::any_of(props.begin(), props.end(), [&](auto &p) {
+      return std::strcmp(p.extensionName, name) == 0;
+    });
+  });
+}
+
 static vk::raii::Instance make_instance(vk::raii::Context &ctx) {
   auto ver = VK_MAKE_VERSION(OGLER_VER_MAJOR, OGLER_VER_MINOR, OGLER_VER_REV);
   vk::ApplicationInfo app_info{
@@ -49,11 +76,16 @@ static vk::raii::Instance make_instance(vk::raii::Context &ctx) {
       "VK_LAYER_KHRONOS_validation",
 #endif
   };
-  const std::vector<const char *> extensions = {
+  std::vector<const char *> extensions = {
 #ifndef NDEBUG
       "VK_EXT_debug_utils",
 #endif
   };
+  if (has_extensions(ctx.enumerateInstanceExtensionProperties(),
+                     host_import_instance_extensions)) {
+    extensions.insert(extensions.end(), host_import_instance_extensions.begin(),
+                      host_import_instance_extensions.end());
+  }
   vk::InstanceCreateInfo instance_create_info{
       .pApplicationInfo = &app_info,
       .enabledLayerCount = static_cast<uint32_t>(layers.size()),
@@ -74,31 +106,60 @@ static uint32_t find_queue_family_index(vk::raii::PhysicalDevice &phys_device) {
                                     }));
 }
 
+static uint32_t get_queue_count(vk::raii::PhysicalDevice &phys_device,
+                                uint32_t queue_family_index) {
+  return phys_device.getQueueFamilyProperties()[queue_family_index].queueCount;
+}
+
+static std::optional<vk::DeviceSize>
+get_host_import_alignment(vk::raii::Context &ctx,
+                          vk::raii::PhysicalDevice &phys_device) {
+  if (!has_extensions(ctx.enumerateInstanceExtensionProperties(),
+                      host_import_instance_extensions) ||
+      !has_extensions(phys_device.enumerateDeviceExtensionProperties(),
+                      host_import_device_extensions)) {
+    return std::nullopt;
+  }
+  auto props = phys_device.getProperties2KHR<
+      vk::PhysicalDeviceProperties2,
+      vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>();
+  return props.get<vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>()
+      .minImportedHostPointerAlignment;
+}
+
+static bool has_unified_memory(vk::raii::PhysicalDevice &phys_device) {
+  auto props = phys_device.getMemoryProperties();
+  auto types = std::span(props.memoryTypes.data(), props.memoryTypeCount);
+  return std::all_of(types.begin(), types.end(), [](const vk::MemoryType &t) {
+    return !(t.propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal) ||
+           (t.propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible);
+  });
+}
+
 static vk::raii::Device init_device(vk::raii::PhysicalDevice &phys_device,
-                                    uint32_t queue_family_index) {
-  float queue_priority = 0.0f;
+                                    uint32_t queue_family_index,
+                                    uint32_t queue_count, bool host_import) {
+  std::vector<float> queue_priorities(queue_count, 0.0f);
   vk::DeviceQueueCreateInfo device_queue_create_info{
       .queueFamilyIndex = queue_family_index,
-      .queueCount = 1,
-      .pQueuePriorities = &queue_priority,
+      .queueCount = queue_count,
+      .pQueuePriorities = queue_priorities.data(),
   };
+  std::vector<const char *> extensions;
+  if (host_import) {
+    extensions.insert(extensions.end(), host_import_device_extensions.begin(),
+                      host_import_device_extensions.end());
+  }
   vk::DeviceCreateInfo device_create_info{
       .queueCreateInfoCount = 1,
       .pQueueCreateInfos = &device_queue_create_info,
+      .enabledExtensionCount = static_cast<uint32_t>(extensions.size()),
+      .ppEnabledExtensionNames = extensions.data(),
   };
 
   return vk::raii::Device(phys_device, device_create_info);
 }
 
-static vk::raii::CommandPool create_command_pool(vk::raii::Device &device,
-                                                 uint32_t queue_family_index) {
-  vk::CommandPoolCreateInfo pool_create_info{
-      .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
-      .queueFamilyIndex = queue_family_index,
-  };
-  return vk::raii::CommandPool(device, pool_create_info);
-}
-
 static VKAPI_ATTR VkBool32 VKAPI_CALL
 debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
               VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -116,8 +177,12 @@ VulkanContext::VulkanContext()
     : ctx(), instance(make_instance(ctx)),
       phys_device(std::move(vk::raii::PhysicalDevices(instance).front())),
       queue_family_index(find_queue_family_index(phys_device)),
-      device(init_device(phys_device, queue_family_index)),
-      command_pool(create_command_pool(device, queue_family_index))
+      queue_count(get_queue_count(phys_device, queue_family_index)),
+      host_import_alignment(get_host_import_alignment(ctx, phys_device)),
+      unified_memory(has_unified_memory(phys_device)),
+      device(init_device(phys_device, queue_family_index, queue_count,
+                         host_import_alignment.has_value())),
+      allocator(phys_device, device)
 #ifndef NDEBUG
       ,
       debug_messenger(instance.createDebugUtilsMessengerEXT({
@@ -132,9 +197,86 @@ VulkanContext::VulkanContext()
 {
 }
 
-vk::raii::CommandBuffer VulkanContext::create_command_buffer() {
+std::string VulkanContext::device_key() {
+  auto props = phys_device.getProperties();
+  std::stringstream ss;
+  ss << std::hex << std::setfill('0') << std::setw(4) << props.vendorID
+     << std::setw(4) << props.deviceID << '-' << std::setw(8)
+     << props.driverVersion << '-';
+  for (auto b : props.pipelineCacheUUID) {
+    ss << std::setw(2) << static_cast<unsigned>(b);
+  }
+  return ss.str();
+}
+
+std::optional<HostBuffer>
+VulkanContext::import_host_memory(std::span<char> data,
+                                  vk::BufferUsageFlags usage) {
+  if (!host_import_alignment) {
+    return std::nullopt;
+  }
+
+  // Only whole, aligned blocks of memory can be imported: import the ones the
+  // data lies in. They are mapped, since they overlap the data.
+  auto align = *host_import_alignment;
+  auto begin = reinterpret_cast<uintptr_t>(data.data());
+  auto base = begin & ~uintptr_t(align - 1);
+  auto end = (begin + data.size() + align - 1) & ~uintptr_t(align - 1);
+  auto host_pointer = reinterpret_cast<void *>(base);
+  auto handle_type = vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+
+  try {
+    auto host_props =
+        device.getMemoryHostPointerPropertiesEXT(handle_type, host_pointer);
+
+    vk::StructureChain<vk::BufferCreateInfo, vk::ExternalMemoryBufferCreateInfo>
+        buffer_info{
+            {
+                .size = end - base,
+                .usage = usage,
+                .sharingMode = vk::SharingMode::eExclusive,
+            },
+            {
+                .handleTypes = handle_type,
+            },
+        };
+    auto buf = device.createBuffer(buffer_info.get<vk::BufferCreateInfo>());
+    auto type_bits =
+        buf.getMemoryRequirements().memoryTypeBits & host_props.memoryTypeBits;
+    if (!type_bits) {
+      return std::nullopt;
+    }
+
+    vk::StructureChain<vk::MemoryAllocateInfo,
+                       vk::ImportMemoryHostPointerInfoEXT>
+        alloc_info{
+            {
+                .allocationSize = end - base,
+                .memoryTypeIndex =
+                    static_cast<uint32_t>(std::countr_zero(type_bits)),
+            },
+            {
+                .handleType = handle_type,
+                .pHostPointer = host_pointer,
+            },
+        };
+    auto mem =
+        device.allocateMemory(alloc_info.get<vk::MemoryAllocateInfo>());
+    buf.bindMemory(*mem, 0);
+    return HostBuffer{
+        .buffer = std::move(buf),
+        .memory = std::move(mem),
+        .offset = begin - base,
+    };
+  } catch (vk::Error &) {
+    return std::nullopt;
+  }
+}
+
+vk::raii::CommandBuffer
+VulkanContext::create_command_buffer(vk::raii::CommandPool &pool) {
   vk::CommandBufferAllocateInfo command_buffer_alloc_info{
-      .commandPool = *command_pool,
+      .commandPool = *pool,
       .level = vk::CommandBufferLevel::ePrimary,
       .commandBufferCount = 1,
   };
@@ -161,26 +303,70 @@ Image VulkanContext::create_image(uint32_t width, uint32_t height,
   create_info.usage = usage;
 
   auto image = device.createImage(create_info);
-
-  auto props = phys_device.getMemoryProperties();
-  auto type_index = std::distance(
-      props.memoryTypes.begin(),
-      std::find_if(props.memoryTypes.begin(), props.memoryTypes.end(),
-                   [](const vk::MemoryType &p) {
-                     return p.propertyFlags &
-                            vk::MemoryPropertyFlagBits::eDeviceLocal;
-                   }));
-  auto reqs = image.getMemoryRequirements();
-  vk::MemoryAllocateInfo alloc_info{
-      .allocationSize = reqs.size,
-      .memoryTypeIndex = static_cast<uint32_t>(type_index),
-  };
-
-  auto mem = device.allocateMemory(alloc_info);
-  image.bindMemory(*mem, 0);
+  auto mem = allocator.allocate(image.getMemoryRequirements(),
+                                vk::MemoryPropertyFlagBits::eDeviceLocal);
+  image.bindMemory(mem.memory(), mem.offset());
   return Image(std::move(image), std::move(mem), format, width, height);
 }
 
+std::optional<MappedImage>
+VulkanContext::create_mapped_image(uint32_t width, uint32_t height,
+                                   vk::Format format,
+                                   vk::ImageUsageFlags usage) {
+  vk::FormatFeatureFlags required;
+  if (usage & vk::ImageUsageFlagBits::eSampled) {
+    required |= vk::FormatFeatureFlagBits::eSampledImage;
+  }
+  if (usage & vk::ImageUsageFlagBits::eStorage) {
+    required |= vk::FormatFeatureFlagBits::eStorageImage;
+  }
+  auto features = phys_device.getFormatProperties(format).linearTilingFeatures;
+  if ((features & required) != required) {
+    return std::nullopt;
+  }
+
+  try {
+    auto limits = phys_device.getImageFormatProperties(
+        format, vk::ImageType::e2D, vk::ImageTiling::eLinear, usage, {});
+    if (width > limits.maxExtent.width || height > limits.maxExtent.height) {
+      return std::nullopt;
+    }
+
+    auto image = device.createImage({
+        .imageType = vk::ImageType::e2D,
+        .format = format,
+        .extent =
+            {
+                .width = width,
+                .height = height,
+                .depth = 1,
+            },
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .tiling = vk::ImageTiling::eLinear,
+        .usage = usage,
+        .initialLayout = vk::ImageLayout::ePreinitialized,
+    });
+
+    auto mem = allocator.allocate(image.getMemoryRequirements(),
+                                  vk::MemoryPropertyFlagBits::eHostVisible |
+                                      vk::MemoryPropertyFlagBits::eHostCoherent,
+                                  vk::MemoryPropertyFlagBits::eDeviceLocal);
+    image.bindMemory(mem.memory(), mem.offset());
+    auto layout = image.getSubresourceLayout({
+        .aspectMask = vk::ImageAspectFlagBits::eColor,
+    });
+    auto map = mem.mapped();
+    return MappedImage{
+        .image = Image(std::move(image), std::move(mem), format, width, height),
+        .map = std::span(map + layout.offset, layout.size),
+        .row_pitch = layout.rowPitch,
+    };
+  } catch (vk::Error &) {
+    return std::nullopt;
+  }
+}
+
 vk::raii::ImageView VulkanContext::create_image_view(Image &img,
                                                      vk::Format format) {
   vk::ImageViewCreateInfo create_info{
@@ -224,8 +410,27 @@ vk::raii::PipelineLayout VulkanContext::create_pipeline_layout(
   return device.createPipelineLayout(create_info);
 }
 
-vk::raii::PipelineCache VulkanContext::create_pipeline_cache() {
-  return device.createPipelineCache(vk::PipelineCacheCreateInfo());
+vk::raii::PipelineCache
+VulkanContext::create_pipeline_cache(std::span<const uint8_t> initial_data) {
+  // Drivers are supposed to reject incompatible data on their own, but not all
+  // of them are careful about it
+  auto props = phys_device.getProperties();
+  vk::PipelineCacheHeaderVersionOne header;
+  if (initial_data.size() >= sizeof(header)) {
+    std::memcpy(&header, initial_data.data(), sizeof(header));
+  }
+  if (initial_data.size() < sizeof(header) ||
+      header.headerVersion != vk::PipelineCacheHeaderVersion::eOne ||
+      header.vendorID != props.vendorID || header.deviceID != props.deviceID ||
+      header.pipelineCacheUUID != props.pipelineCacheUUID) {
+    initial_data = {};
+  }
+
+  vk::PipelineCacheCreateInfo create_info{
+      .initialDataSize = initial_data.size(),
+      .pInitialData = initial_data.data(),
+  };
+  return device.createPipelineCache(create_info);
 }
 
 vk::raii::Pipeline VulkanContext::create_compute_pipeline(
@@ -29,39 +29,57 @@
 #define VULKAN_HPP_NO_STRUCT_CONSTRUCTORS
 #include <vulkan/vulkan_raii.hpp>
 
+#include "vulkan_allocator.hpp"
+
 #include <optional>
 #include <span>
+#include <string>
 #include <utility>
 
 namespace ogler {
 struct Image {
+  // Declared first so that the image is destroyed before its memory is reused
+  Allocation memory;
   vk::raii::Image image;
-  vk::raii::DeviceMemory memory;
   vk::Format format;
 
   int width;
   int height;
 
-  Image(vk::raii::Image &&img, vk::raii::DeviceMemory &&mem, vk::Format fmt,
-        int w, int h)
-      : image(std::move(img)), memory(std::move(mem)), format(fmt), width(w),
+  Image(vk::raii::Image &&img, Allocation &&mem, vk::Format fmt, int w, int h)
+      : memory(std::move(mem)), image(std::move(img)), format(fmt), width(w),
         height(h) {}
 };
 
+// Linear image in host-visible memory, written in place through map. Rows
+// are row_pitch bytes apart.
+struct MappedImage {
+  Image image;
+  std::span<char> map;
+  vk::DeviceSize row_pitch;
+};
+
 template <typename T = char> struct Buffer {
+  // Declared first so that the buffer is destroyed before its memory is reused
+  Allocation memory;
   vk::raii::Buffer buffer;
-  vk::raii::DeviceMemory memory;
   std::span<T> map;
 
   int size;
 
-  Buffer(vk::raii::Buffer &&buf, vk::raii::DeviceMemory &&mem, int sz,
-         bool do_map)
-      : buffer(std::move(buf)), memory(std::move(mem)), size(sz),
-        map(do_map
-                ? std::span<T>(
-                      static_cast<T *>(memory.mapMemory(0, sz * sizeof(T))), sz)
-                : std::span<T>()) {}
+  Buffer(vk::raii::Buffer &&buf, Allocation &&mem, int sz, bool do_map)
+      : memory(std::move(mem)), buffer(std::move(buf)),
+        map(do_map ? std::span<T>(reinterpret_cast<T *>(memory.mapped()), sz)
+                   : std::span<T>()),
+        size(sz) {}
+};
+
+// Host memory the GPU reads from directly. The data starts at offset, since
+// the imported range has to be aligned.
+struct HostBuffer {
+  vk::raii::Buffer buffer;
+  vk::raii::DeviceMemory memory;
+  vk::DeviceSize offset;
 };
 
 class VulkanContext {
@@ -70,49 +88,63 @@ public:
   vk::raii::Instance instance;
   vk::raii::PhysicalDevice phys_device;
   uint32_t queue_family_index;
+  // Queues of that family, all of which are created with the device
+  uint32_t queue_count;
+  // Set if VK_EXT_external_memory_host is enabled
+  std::optional<vk::DeviceSize> host_import_alignment;
+  // Device-local memory is also host-visible, as on integrated GPUs and
+  // software implementations: resources can be accessed in place instead of
+  // through staging buffers
+  bool unified_memory;
   vk::raii::Device device;
-  vk::raii::CommandPool command_pool;
+  // Memory for everything created through create_buffer and create_image
+  MemoryAllocator allocator;
 
   std::optional<vk::raii::DebugUtilsMessengerEXT> debug_messenger;
 
   VulkanContext();
 
+  // Identifies the device and driver version, for keying on-disk caches
+  std::string device_key();
+
+  // The memory has all of properties, and as many of preferred as possible
   template <typename T>
   Buffer<T> create_buffer(vk::BufferCreateFlags create_flags,
                           vk::DeviceSize size, vk::BufferUsageFlags usage_flags,
                           vk::SharingMode sharing_mode,
-                          vk::MemoryPropertyFlags properties, bool map = true) {
+                          vk::MemoryPropertyFlags properties, bool map = true,
+                          vk::MemoryPropertyFlags preferred = {}) {
     vk::BufferCreateInfo info{
         .flags = create_flags,
         .size = size * sizeof(T),
         .usage = usage_flags,
         .sharingMode = sharing_mode,
     };
-    auto props = phys_device.getMemoryProperties();
-    auto type_index = std::distance(
-        props.memoryTypes.begin(),
-        std::find_if(props.memoryTypes.begin(), props.memoryTypes.end(),
-                     [properties](const auto &p) {
-                       return (p.propertyFlags & properties) == properties;
-                     }));
     auto buf = device.createBuffer(info);
-    auto reqs = buf.getMemoryRequirements();
-    vk::MemoryAllocateInfo alloc_info{
-        .allocationSize = reqs.size,
-        .memoryTypeIndex = static_cast<uint32_t>(type_index),
-    };
-
-    auto mem = device.allocateMemory(alloc_info);
-    buf.bindMemory(*mem, 0);
+    auto mem = allocator.allocate(buf.getMemoryRequirements(), properties,
+                                  preferred);
+    buf.bindMemory(mem.memory(), mem.offset());
 
     return Buffer<T>(std::move(buf), std::move(mem), size, map);
   }
 
-  vk::raii::CommandBuffer create_command_buffer();
+  // Returns nullopt if the memory can't be imported, in which case it has to
+  // be copied to a buffer created by create_buffer instead
+  std::optional<HostBuffer> import_host_memory(std::span<char> data,
+                                               vk::BufferUsageFlags usage);
+
+  vk::raii::CommandBuffer create_command_buffer(vk::raii::CommandPool &pool);
 
   Image create_image(uint32_t width, uint32_t height, vk::Format format,
                      vk::ImageTiling tiling, vk::ImageUsageFlags usage);
 
+  // Returns nullopt if the device can't use the format with linear tiling for
+  // the given usage. The image is in the Preinitialized layout.
+  std::optional<MappedImage> create_mapped_image(uint32_t width,
+                                                 uint32_t height,
+                                                 vk::Format format,
+                                                 vk::ImageUsageFlags usage);
+
   vk::raii::ImageView create_image_view(Image &img, vk::Format format);
 
   vk::raii::ShaderModule create_shader_module(std::span<const unsigned> code);
@@ -121,7 +153,9 @@ public:
   create_pipeline_layout(vk::raii::DescriptorSetLayout &descriptor_set_layout,
                          int push_constants_size);
 
-  vk::raii::PipelineCache create_pipeline_cache();
+  // Initial data that was saved by a different device or driver is ignored
+  vk::raii::PipelineCache
+  create_pipeline_cache(std::span<const uint8_t> initial_data = {});
 
   vk::raii::Pipeline
   create_compute_pipeline(vk::raii::ShaderModule &module,
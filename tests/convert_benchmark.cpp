@@ -0,0 +1,81 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+// Compares the double to float conversions used for gmem uploads, over the
+// amount of data a frame with many dirty gmem blocks converts
+
+#include "ogler_convert.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace ogler;
+
+// 64 EEL RAM blocks of 65536 items
+static constexpr size_t num_items = size_t(64) << 16;
+static constexpr int iterations = 50;
+
+int main() {
+  std::vector<double> src(num_items);
+  std::mt19937_64 rng(0);
+  std::uniform_real_distribution<double> dist(-1e6, 1e6);
+  std::generate(src.begin(), src.end(), [&]() { return dist(rng); });
+
+  std::vector<float> expected(num_items);
+  std::transform(src.begin(), src.end(), expected.begin(),
+                 [](double x) { return static_cast<float>(x); });
+
+  // Offset by one float, so that the unaligned head is exercised too
+  std::vector<float> dst(num_items + 1);
+  int failures = 0;
+  std::printf("%-8s %10s %10s\n", "impl", "ms/iter", "GB/s");
+  for (auto &impl : convert_to_float_impls()) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      impl.func(src.data(), dst.data() + 1, num_items);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    auto seconds = elapsed.count() / iterations;
+    auto bytes = num_items * (sizeof(double) + sizeof(float));
+    std::printf("%-8s %10.3f %10.2f%s\n", impl.name, seconds * 1e3,
+                bytes / seconds / 1e9,
+                std::strcmp(impl.name, convert_to_float_impl_name()) == 0
+                    ? " (selected)"
+                    : "");
+
+    if (!std::equal(expected.begin(), expected.end(), dst.begin() + 1)) {
+      std::printf("%s: wrong result\n", impl.name);
+      ++failures;
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,428 @@
+/*
+    Ogler - Use GLSL shaders in REAPER
+    Copyright (C) 2023  Francesco Bertolaccini <francesco@bertolaccini.dev>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with Sciter (or a modified version of that library),
+    containing parts covered by the terms of Sciter's EULA, the licensors
+    of this Program grant you additional permission to convey the
+    resulting work.
+*/
+
+// Renders many instances at once against the mock REAPER, each on its own
+// thread, like REAPER does with the tracks of a project. More instances than
+// the device has queues, so some of them share a queue. They all read the
+// same source and gmem, and every other one also reads the output of the
+// one before it, like a chain of effects.
+
+#include "ogler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace ogler {
+HINSTANCE get_hinstance() { return GetModuleHandle(nullptr); }
+
+static std::unique_ptr<SharedVulkan> shared_vulkan;
+
+SharedVulkan &Ogler::get_shared_vulkan() { return *shared_vulkan; }
+
+struct OglerTestAccess {
+  static constexpr int max_frames_in_flight = Ogler::max_frames_in_flight;
+
+  static IVideoFrame *render(Ogler &plugin, double project_time) {
+    double wet = 1.0;
+    auto vproc = plugin.vproc.get();
+    return vproc->process_frame(vproc, &wet, 1, project_time, 30.0, 0);
+  }
+
+  // Replaces the mock's video processor, which has no inputs
+  static void
+  set_video_processor(Ogler &plugin,
+                      std::unique_ptr<IREAPERVideoProcessor> vproc) {
+    std::unique_lock<std::mutex> lock(plugin.video_mutex);
+    vproc->userdata = plugin.vproc->userdata;
+    vproc->process_frame = plugin.vproc->process_frame;
+    vproc->get_parameter_value = plugin.vproc->get_parameter_value;
+    plugin.vproc = std::move(vproc);
+  }
+
+  static void set_frames_in_flight(Ogler &plugin, int frames) {
+    plugin.data.frames_in_flight = frames;
+    plugin.requested_frames_in_flight = frames;
+  }
+
+  // Only the first block of gmem is allocated
+  static void write_gmem(Ogler &plugin, size_t index, double value) {
+    std::unique_lock<EELMutex> lock(*plugin.eel_mutex);
+    (*plugin.gmem)[0][index] = value;
+  }
+
+  // Pipelines some instance
+  static size_t live_pipelines() {
+    auto &pipelines = shared_vulkan->pipelines;
+    std::unique_lock<std::mutex> lock(pipelines.mutex);
+    return static_cast<size_t>(
+        std::ranges::count_if(pipelines.entries, [](auto &entry) {
+          return !entry.second.expired();
+        }));
+  }
+};
+} // namespace ogler
+
+using namespace ogler;
+
+static constexpr int num_instances = 16;
+static constexpr int frames_per_instance = 240;
+static constexpr auto compile_timeout = std::chrono::seconds(60);
+// Large enough to be imported rather than copied to staging
+static constexpr int source_width = 512;
+static constexpr int source_height = 512;
+
+static const clap_host_log_t host_log{
+    .log = [](const clap_host_t *, clap_log_severity,
+              const char *msg) { std::fprintf(stderr, "%s\n", msg); },
+};
+
+static const clap::host host{{
+    .clap_version = CLAP_VERSION,
+    .name = "ogler stress test",
+    .vendor = "ogler",
+    .url = "",
+    .version = "",
+    .get_extension = [](const clap_host_t *, const char *id) -> const void * {
+      return std::string_view{id} == CLAP_EXT_LOG ? &host_log : nullptr;
+    },
+    .request_restart = [](const clap_host_t *) {},
+    .request_process = [](const clap_host_t *) {},
+    .request_callback = [](const clap_host_t *) {},
+}};
+
+// RGBA frames in plain memory, freed on the last Release
+class TestVideoFrame final : public IVideoFrame {
+  std::atomic<int> refs = 1;
+  std::vector<char> bits;
+  int w;
+  int h;
+
+public:
+  // Frame of the source it holds, if any
+  int source_frame = -1;
+
+  TestVideoFrame(int w, int h) : bits(size_t(w) * h * 4), w(w), h(h) {}
+
+  bool is_unshared() const { return refs == 1; }
+
+  void AddRef() { ++refs; }
+  void Release() {
+    if (--refs == 0) {
+      delete this;
+    }
+  }
+
+  char *get_bits() { return bits.data(); }
+  int get_w() { return w; }
+  int get_h() { return h; }
+  int get_fmt() { return 'RGBA'; }
+  int get_rowspan() { return w * 4; }
+  void resize_img(int wantw, int wanth, int wantfmt) {
+    w = wantw;
+    h = wanth;
+    bits.resize(size_t(w) * h * 4);
+  }
+};
+
+// The video every instance reads, like an item on a parent track. Frames are
+// recycled once nobody else holds them, like REAPER does, so the same memory
+// keeps coming back.
+class SharedSource {
+  std::mutex mutex;
+  std::vector<TestVideoFrame *> frames;
+
+public:
+  ~SharedSource() {
+    for (auto frame : frames) {
+      frame->Release();
+    }
+  }
+
+  // The caller owns a reference
+  IVideoFrame *render(int index) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = std::ranges::find(frames, index, &TestVideoFrame::source_frame);
+    if (it == frames.end()) {
+      it = std::ranges::find_if(frames, &TestVideoFrame::is_unshared);
+      if (it == frames.end()) {
+        it = frames.insert(frames.end(),
+                           new TestVideoFrame(source_width, source_height));
+      }
+      (*it)->source_frame = index;
+      std::memset((*it)->get_bits(), index % 256,
+                  size_t(source_width) * source_height * 4);
+    }
+    (*it)->AddRef();
+    return *it;
+  }
+};
+
+// The last output of an instance, read by the one after it
+class OutputSlot {
+  std::mutex mutex;
+  IVideoFrame *frame = nullptr;
+
+public:
+  ~OutputSlot() {
+    if (frame) {
+      frame->Release();
+    }
+  }
+
+  // Takes over the caller's reference
+  void publish(IVideoFrame *output) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (frame) {
+      frame->Release();
+    }
+    frame = output;
+  }
+
+  // The caller owns a reference. Null until the first output.
+  IVideoFrame *get() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (frame) {
+      frame->AddRef();
+    }
+    return frame;
+  }
+};
+
+// Input 0 is the shared source, input 1 the output of the instance upstream,
+// if any
+class TestVideoProcessor final : public IREAPERVideoProcessor {
+  SharedSource &source;
+  OutputSlot *upstream;
+  // Frames handed out stay valid until the next request for the same input,
+  // like in REAPER
+  IVideoFrame *held[2]{};
+
+public:
+  // Set by the thread rendering the instance
+  int frame_index = 0;
+
+  TestVideoProcessor(SharedSource &source, OutputSlot *upstream)
+      : source(source), upstream(upstream) {}
+  ~TestVideoProcessor() {
+    for (auto frame : held) {
+      if (frame) {
+        frame->Release();
+      }
+    }
+  }
+
+  IVideoFrame *newVideoFrame(int w, int h, int fmt) {
+    return new TestVideoFrame(w, h);
+  }
+
+  int getNumInputs() { return upstream ? 2 : 1; }
+  int getInputInfo(int idx, void **itemptr) { return 0; }
+  IVideoFrame *renderInputVideoFrame(int idx, int want_fmt) {
+    if (idx >= getNumInputs()) {
+      return nullptr;
+    }
+    auto frame = idx == 0 ? source.render(frame_index) : upstream->get();
+    if (held[idx]) {
+      held[idx]->Release();
+    }
+    held[idx] = frame;
+    return frame;
+  }
+};
+
+// Reads every kind of input, and writes opaque pixels everywhere. Some of
+// the instances only declare part of gmem, so that its copy on the GPU gets
+// replaced by one covering both.
+static std::string chained_shader(bool gmem_range) {
+  std::string source =
+      gmem_range ? "const uvec2 ogler_gmem_range = uvec2(0, 16);\n" : "";
+  return source + R"(
+void mainImage(out vec4 fragColor, in vec2 fragCoord) {
+    vec2 uv = fragCoord / iResolution.xy;
+    vec3 source = texture(iChannel[0], uv).rgb;
+    vec3 upstream = texture(iChannel[1], uv).rgb;
+    fragColor = vec4(mix(source, upstream, 0.5) * gmem[0], 1.0);
+})";
+}
+
+// Writes opaque pixels everywhere. Renaming its variable doesn't change what
+// it compiles to.
+static std::string renamed_shader(const std::string &name) {
+  std::string source = R"(
+void mainImage(out vec4 fragColor, in vec2 fragCoord) {
+    vec2 uv = fragCoord / iResolution.xy;
+    fragColor = vec4(uv, 0.5, 1.0);
+})";
+  for (auto pos = source.find("uv"); pos != std::string::npos;
+       pos = source.find("uv", pos + name.size())) {
+    source.replace(pos, 2, name);
+  }
+  return source;
+}
+
+static Ogler &create_instance(std::vector<std::unique_ptr<Ogler>> &instances,
+                              std::string shader) {
+  auto &plugin = instances.emplace_back(std::make_unique<Ogler>(host));
+  plugin->data.video_shader = std::move(shader);
+  plugin->init();
+  plugin->activate(48000, 1, 512);
+  return *plugin;
+}
+
+static void destroy_instances(std::vector<std::unique_ptr<Ogler>> &instances) {
+  for (auto &plugin : instances) {
+    plugin->deactivate();
+  }
+  instances.clear();
+}
+
+// Renders until the instance has compiled its shader
+static bool wait_compiled(Ogler &plugin) {
+  auto deadline = std::chrono::steady_clock::now() + compile_timeout;
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (auto output = OglerTestAccess::render(plugin, 0.0)) {
+      output->Release();
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+// The preprocessor already strips comments, but sources that only differ in
+// the names of their identifiers also compile to the same pipeline
+static int test_renamed_sources_share_pipeline() {
+  // One after the other, so that the second one finds the workgroup size the
+  // first one was tuned to
+  std::vector<std::unique_ptr<Ogler>> instances;
+  int failures = 0;
+  if (!wait_compiled(create_instance(instances, renamed_shader("uv"))) ||
+      !wait_compiled(
+          create_instance(instances, renamed_shader("coordinates")))) {
+    std::fprintf(stderr, "renamed sources: timed out\n");
+    ++failures;
+  } else if (auto n = OglerTestAccess::live_pipelines(); n != 1) {
+    std::fprintf(stderr, "renamed sources: %zu pipelines instead of 1\n", n);
+    ++failures;
+  }
+  destroy_instances(instances);
+  return failures;
+}
+
+// The shaders here write opaque pixels everywhere
+static bool is_opaque(IVideoFrame *frame) {
+  auto bits = frame->get_bits();
+  for (int y = 0; y < frame->get_h(); ++y) {
+    for (int x = 0; x < frame->get_w(); ++x) {
+      if (static_cast<unsigned char>(
+              bits[y * frame->get_rowspan() + x * 4 + 3]) != 255) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main() {
+  shared_vulkan = std::make_unique<SharedVulkan>();
+
+  std::atomic<int> failures = test_renamed_sources_share_pipeline();
+
+  // Outlive shared_vulkan, which may still have their frames imported
+  SharedSource source;
+  std::vector<OutputSlot> outputs(num_instances);
+
+  std::vector<std::unique_ptr<Ogler>> instances;
+  std::vector<TestVideoProcessor *> processors;
+  for (int i = 0; i < num_instances; ++i) {
+    auto &plugin = create_instance(instances, chained_shader(i % 4 == 3));
+    OglerTestAccess::set_frames_in_flight(
+        plugin, 1 + i % OglerTestAccess::max_frames_in_flight);
+    auto vproc = std::make_unique<TestVideoProcessor>(
+        source, i % 2 == 1 ? &outputs[i - 1] : nullptr);
+    processors.push_back(vproc.get());
+    OglerTestAccess::set_video_processor(plugin, std::move(vproc));
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_instances; ++i) {
+    threads.emplace_back([&, i]() {
+      auto &plugin = *instances[i];
+      auto deadline = std::chrono::steady_clock::now() + compile_timeout;
+      int num_outputs = 0;
+      int frame = 0;
+      while (frame < frames_per_instance) {
+        processors[i]->frame_index = frame;
+        OglerTestAccess::write_gmem(plugin, 0, 0.5 + 0.5 * (frame % 2));
+        auto output = OglerTestAccess::render(plugin, frame / 30.0);
+        if (!output) {
+          // Still compiling, or the frames in flight are filling up
+          if (std::chrono::steady_clock::now() > deadline) {
+            std::fprintf(stderr, "instance %d: timed out\n", i);
+            ++failures;
+            return;
+          }
+          if (num_outputs == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+          }
+        } else {
+          if (!is_opaque(output)) {
+            std::fprintf(stderr, "instance %d: wrong output at frame %d\n", i,
+                         frame);
+            ++failures;
+          }
+          outputs[i].publish(output);
+          ++num_outputs;
+        }
+        ++frame;
+      }
+      if (num_outputs <
+          frames_per_instance - OglerTestAccess::max_frames_in_flight) {
+        std::fprintf(stderr, "instance %d: only %d outputs\n", i,
+                     num_outputs);
+        ++failures;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  destroy_instances(instances);
+  shared_vulkan = nullptr;
+
+  std::printf("%d instances, %d failures\n", num_instances, failures.load());
+  return failures == 0 ? 0 : 1;
+}